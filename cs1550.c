@@ -12,12 +12,39 @@
 
 #define	FUSE_USE_VERSION 26
 
+//for O_DIRECT
+#define _GNU_SOURCE
+
 #include <fuse.h>
 #include <stdio.h>
 #include <string.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+
+//io_uring is used whenever the headers know about it, everything else goes
+//through pread/pwrite
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+//linux/fs.h has a BLOCK_SIZE of its own
+#undef BLOCK_SIZE
 
 //size of a disk block
 #define	BLOCK_SIZE 512
@@ -27,18 +54,13 @@
 #define	MAX_EXTENSION 3
 
 //How many files can there be in one directory?
-#define MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
-#define NODE_POINTERS (BLOCK_SIZE - sizeof(int) - sizeof(long)) / sizeof(long)
-#define END_OF_BITMAP (5 * BLOCK_SIZE - 1)
-
-//////////////////////////////////////////////////////////////////////////
-/////////////////////////// SECTION COMPLETE /////////////////////////////
-//////////////////////////////////////////////////////////////////////////
-
-struct cs1550_bitmap {
+#define MAX_FILES_IN_DIR ((BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long)))
+#define NODE_POINTERS ((BLOCK_SIZE - sizeof(int) - sizeof(long)) / sizeof(long))
 
-	unsigned char bitmap[5 * BLOCK_SIZE];
-};
+//The bitmap images start out with: the last five blocks of the disk, where
+//byte 0 and anything past the last byte are never handed out
+#define BITMAP_BLOCKS 5
+#define END_OF_BITMAP (BITMAP_BLOCKS * BLOCK_SIZE - 1)
 
 //////////////////////////////////////////////////////////////////////////
 /////////////////////////// SECTION COMPLETE /////////////////////////////
@@ -69,7 +91,7 @@ struct cs1550_directory_entry
 
 typedef struct cs1550_root_directory cs1550_root_directory;
 
-#define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
+#define MAX_DIRS_IN_ROOT ((BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long)))
 
 struct cs1550_root_directory
 {
@@ -81,15 +103,48 @@ struct cs1550_root_directory
 		long nStartBlock;				//where the directory block is on disk
 	} __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];	//There is an array of these
 
+	long nSuperBlock __attribute__((packed));	//where the superblock is, 0 if there is none
+
 	//This is some space to get this to be exactly the size of the disk block.
 	//Don't use it for anything.
-	char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int)];
+	char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int) - sizeof(long)];
 } ;
 
 //////////////////////////////////////////////////////////////////////////
 /////////////////////////// SECTION COMPLETE /////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+//Names can be this long everywhere but in the fixed slots above, which keep
+//their 8.3 names. A fixed-slot directory grows through a slot with an empty
+//name, holding the first block of a chain of the newer kind below.
+#define MAX_NAME 255
+
+//The newer directories are chains of blocks packed with variable-length
+//records. The magic tells such a block apart from a fixed-slot one, whose
+//first int is a small count.
+#define DIRENT_MAGIC 0x544e455249443531L
+
+struct cs1550_dirent
+{
+	long nStartBlock;		//a directory's first block, or a file's index node
+	size_t fsize;			//file size, 0 for a directory
+	unsigned char type;		//DT_DIR or DT_REG
+	unsigned char length;	//how long the name is; it follows, without a nul
+} __attribute__((packed));
+
+struct cs1550_dirent_block
+{
+	long magic;
+	long nNextBlock;	//where the directory goes on, 0 at the end
+	int used;			//bytes of records in use
+
+	char records[BLOCK_SIZE - 2 * sizeof(long) - sizeof(int)];
+};
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
 typedef struct cs1550_directory_entry cs1550_directory_entry;
 
 //How much data can one block hold?
@@ -111,8 +166,8 @@ struct cs1550_disk_block
 //////////////////////////////////////////////////////////////////////////
 
 struct cs1550_node {
-	int next_node;
-	long value;
+	int next_node;	//how many of node_pointers are in use
+	long value;		//NODE_* flags
 	long node_pointers[NODE_POINTERS];
 };
 
@@ -122,922 +177,9170 @@ struct cs1550_node {
 
 typedef struct cs1550_node cs1550_node;
 
-static long directory_offset(FILE *file, char *dir) {
+//Every fuse_operations callback we keep numbers for
+enum cs1550_operation {
+	OP_GETATTR,
+	OP_READDIR,
+	OP_MKDIR,
+	OP_RMDIR,
+	OP_MKNOD,
+	OP_UNLINK,
+	OP_READ,
+	OP_WRITE,
+	OP_TRUNCATE,
+	OP_OPEN,
+	OP_FLUSH,
+	OP_IOCTL,
+	OP_FALLOCATE,
+	OP_FSYNC,
+	OP_SETXATTR,
+	OP_GETXATTR,
+	OP_LISTXATTR,
+	OP_REMOVEXATTR,
+	OP_COUNT
+};
 
-	cs1550_root_directory root;
+static const char *operation_names[OP_COUNT] = {
+	"getattr", "readdir", "mkdir", "rmdir", "mknod", "unlink",
+	"read", "write", "truncate", "open", "flush", "ioctl",
+	"fallocate", "fsync", "setxattr", "getxattr", "listxattr",
+	"removexattr"
+};
 
-	if (fseek(file, 0, SEEK_SET) == 0) {
-		if (fread(&root, 1, BLOCK_SIZE, file) == BLOCK_SIZE) {
+//Every fixed-size object pool. Block buffers are the only one for now, but
+//anything allocated over and over on the hot path belongs in one.
+enum cs1550_pool_id {
+	POOL_BLOCK,
+	POOL_COUNT
+};
 
-			int directories = root.nDirectories;
-			int index;
+//Latencies are bucketed by powers of two nanoseconds: bucket n holds the
+//calls that took less than 2^n ns, the last one holds everything slower
+#define STATS_BUCKETS 32
 
-			for (index = 0; index < directories; index++) {
+//The virtual file the counters are rendered into, and where they are dumped
+//on unmount
+#define STATS_FILE "/.stats"
+#define STATS_DUMP ".disk.stats"
 
-				if (strcmp(dir, root.directories[index].dname) == 0) {
-					return root.directories[index].nStartBlock;
-				}
-			}
-		}
-	}
+//Each thread only ever writes its own copy, so recording needs no locks.
+//Readers sum every copy on the list when the stats are rendered.
+struct cs1550_stats {
 
-	return 0;
-}
+	uint64_t calls[OP_COUNT];
+	uint64_t errors[OP_COUNT];
+	uint64_t nanoseconds[OP_COUNT];
+	uint64_t latency[OP_COUNT][STATS_BUCKETS];
 
-//////////////////////////////////////////////////////////////////////////
-/////////////////////////// SECTION COMPLETE /////////////////////////////
-//////////////////////////////////////////////////////////////////////////
+	uint64_t file_bytes_read;
+	uint64_t file_bytes_written;
 
-int write(FILE *file, cs1550_directory_entry entry, long location, char filename[MAX_FILENAME + 1], char extension[MAX_EXTENSION + 1], size_t size, long nStartBlock) {
+	uint64_t blocks_read;
+	uint64_t blocks_written;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
 
-	int current;
+	uint64_t compress_in;
+	uint64_t compress_out;
 
-	if (entry.nFiles == MAX_FILES_IN_DIR) {
-		return -1;
-	}
+	uint64_t dedup_hits;
+	uint64_t dedup_stored;
 
-	for (current = 0; current < MAX_FILES_IN_DIR; current++) {
+	uint64_t io_batches;
+	uint64_t io_requests;
 
-		if (entry.files[current].fsize == -1) {
+	uint64_t pool_gets[POOL_COUNT];
+	uint64_t pool_refills[POOL_COUNT];
 
-			strcpy(entry.files[current].fname, filename);
-			strcpy(entry.files[current].fext, extension);
+	uint64_t checksum_bytes;
+	uint64_t checksum_nanoseconds;
+	uint64_t checksum_errors;
 
-			entry.files[current].fsize = size;
-			entry.files[current].nStartBlock = nStartBlock;
+	uint64_t dentry_hits;
+	uint64_t dentry_negative_hits;
+	uint64_t dentry_misses;
 
-			entry.nFiles++;
+	uint64_t defrag_files;
+	uint64_t defrag_blocks;
 
-			fseek(file, BLOCK_SIZE * location, SEEK_SET);
-			fwrite(&entry, 1, BLOCK_SIZE, file);
+	uint64_t xattr_hits;
+	uint64_t xattr_misses;
 
-			return 1;
-		}
-	}
+	struct cs1550_stats *next;
+};
 
-	return -1;
-}
+static struct cs1550_stats *all_stats;
+static __thread struct cs1550_stats *thread_stats;
 
 //////////////////////////////////////////////////////////////////////////
 /////////////////////////// SECTION COMPLETE /////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-static int retrieve_block(FILE *file) {
-
-	struct cs1550_bitmap bitmap;
-
-	if (fread(&bitmap, 1, BLOCK_SIZE * 5, file) == (END_OF_BITMAP + 1)) {
-
-		int index;
-		int x;
+static struct cs1550_stats *stats_local(void) {
 
-		for (index = 1; index < END_OF_BITMAP; index++) {
+	struct cs1550_stats *stats = thread_stats;
 
-			if (bitmap.bitmap[index] < 255) {
+	if (stats == NULL) {
 
-				unsigned char bits = 128;
-				unsigned char mark = bitmap.bitmap[index] + 1;
+		stats = calloc(1, sizeof(struct cs1550_stats));
 
-				for (x = 7; (bits ^ mark) != 0; bits >>= 1, x--);
+		if (stats == NULL) {
+			return NULL;
+		}
 
-				x += (index * 8);
-				bitmap.bitmap[index] = bitmap.bitmap[index] | mark;
+		//push onto the shared list, the only write other threads can see
+		stats->next = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE);
 
-				break;
-			}
-		}
+		while (!__atomic_compare_exchange_n(&all_stats, &stats->next, stats, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
 
-		if (fwrite(bitmap.bitmap, 1, BLOCK_SIZE * 5, file) == END_OF_BITMAP + 1) {
-			return x;
-		}
+		thread_stats = stats;
 	}
 
-	return -1;
+	return stats;
 }
 
-//////////////////////////////////////////////////////////////////////////
-/////////////////////////// SECTION COMPLETE /////////////////////////////
-//////////////////////////////////////////////////////////////////////////
+static void stats_add(uint64_t *counter, uint64_t amount) {
 
-int add_node(FILE *file, cs1550_node node, long this_node_location, long next_node_location) {
+	//single writer, so a plain load and relaxed store is enough to keep
+	//readers from ever seeing a torn value
+	__atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
 
-	if (node.value == 0) {
+static uint64_t stats_now(void) {
 
-		node.node_pointers[node.next_node] = next_node_location;
-		node.next_node++;
+	struct timespec now;
 
-		if (fseek(file, this_node_location * BLOCK_SIZE, SEEK_SET) == 0) {
-			if (fwrite(&node, 1, BLOCK_SIZE, file) == BLOCK_SIZE) {
-				return 1;
-			}
-		}
-	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	return -1;
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-//////////////////////////////////////////////////////////////////////////
-/////////////////////////// SECTION COMPLETE /////////////////////////////
-//////////////////////////////////////////////////////////////////////////
+static void stats_record(enum cs1550_operation operation, uint64_t start, int res) {
 
-typedef struct cs1550_disk_block cs1550_disk_block;
+	struct cs1550_stats *stats = stats_local();
+	uint64_t elapsed = stats_now() - start;
+	int bucket = 0;
 
-/*
- * Called whenever the system wants to know the file attributes, including
- * simply whether the file exists or not.
- *
- * man -s 2 stat will show the fields of a stat structure
- */
+	if (stats == NULL) {
+		return;
+	}
 
-static int cs1550_getattr(const char *path, struct stat *stbuf) {
+	if (elapsed) {
+		bucket = 64 - __builtin_clzll(elapsed);
+	}
 
-	int directory_files
-	int file_location;
-	int index = 0;
-	int res = 0;
+	if (bucket >= STATS_BUCKETS) {
+		bucket = STATS_BUCKETS - 1;
+	}
 
-	long directory_location = -1;
-	long file_start = -1;
+	stats_add(&stats->calls[operation], 1);
+	stats_add(&stats->nanoseconds[operation], elapsed);
+	stats_add(&stats->latency[operation][bucket], 1);
 
-	cs1550_root_directory root;
-	cs1550_directory_entry entry;
+	if (res < 0) {
+		stats_add(&stats->errors[operation], 1);
+	}
 
-	FILE *file;
+	else if (operation == OP_READ) {
+		stats_add(&stats->file_bytes_read, res);
+	}
 
-	memset(stbuf, 0, sizeof(struct stat));
+	else if (operation == OP_WRITE) {
+		stats_add(&stats->file_bytes_written, res);
+	}
+}
 
-	char extension[MAX_EXTENSION + 1];
-	char directory[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
+static void stats_blocks(int written, long count) {
 
-	memset(extension, 0, MAX_EXTENSION + 1);
-	memset(directory, 0, MAX_FILENAME + 1);
-	memset(filename, 0, MAX_FILENAME + 1);
+	struct cs1550_stats *stats = stats_local();
 
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	if (stats == NULL) {
+		return;
+	}
 
-	//is path the root dir?
-	if (strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
+	if (written) {
+		stats_add(&stats->blocks_written, count);
+		stats_add(&stats->bytes_written, count * BLOCK_SIZE);
 	}
 
 	else {
-		if (directory[0] && directory[MAX_FILENAME] == '\0' && filename[MAX_FILENAME] == '\0' && extension[MAX_EXTENSION] == '\0') {
+		stats_add(&stats->blocks_read, count);
+		stats_add(&stats->bytes_read, count * BLOCK_SIZE);
+	}
+}
 
-			file = fopen(".disk", "rb");
+static void stats_cache(int hit) {
 
-			if (file) {
+	struct cs1550_stats *stats = stats_local();
 
-				directory_location = directory_offset(file, directory);
+	if (stats) {
+		stats_add(hit ? &stats->cache_hits : &stats->cache_misses, 1);
+	}
+}
 
-				if (directory_location) {
-					if (filename[0] == '\0') {
+static void stats_compressed(uint64_t in, uint64_t out) {
 
-						//Might want to return a structure with these fields
-						stbuf->st_mode = S_IFDIR | 0755;
-						stbuf->st_nlink = 2;
-						res = 0; //no error
-					}
+	struct cs1550_stats *stats = stats_local();
 
-					else {
-						if (fseek(file, BLOCK_SIZE *directory_location, SEEK_SET) == 0) {
-							if (fread(&entry, 1, BLOCK_SIZE, file) == BLOCK_SIZE) {
+	if (stats) {
+		stats_add(&stats->compress_in, in);
+		stats_add(&stats->compress_out, out);
+	}
+}
 
-								directory_files = entry.nFiles;
+//bytes checksummed, how long that took and how many blocks failed
+static void stats_checksum(uint64_t bytes, uint64_t nanoseconds, uint64_t errors) {
 
-								for (file_location = 0; file_location < directory_files; file_location++) {
+	struct cs1550_stats *stats = stats_local();
 
-									if ((strcmp(extension, entry.files[file_location].fext) == 0) && (strcmp(filename, entry.files[file_location].fname) == 0)) {
-										file_start = root.directories[index].nStartBlock;
-									}
-								}
+	if (stats) {
+		stats_add(&stats->checksum_bytes, bytes);
+		stats_add(&stats->checksum_nanoseconds, nanoseconds);
+		stats_add(&stats->checksum_errors, errors);
+	}
+}
 
-								if (file_start == -1) {
+//refill is 1 when the thread's own free list ran dry and had to be topped up
+static void stats_pool(enum cs1550_pool_id pool, int refill) {
 
-									fclose(file);
-									return -ENOENT;
-								}
+	struct cs1550_stats *stats = stats_local();
 
-								else {
+	if (stats) {
+		stats_add(refill ? &stats->pool_refills[pool] : &stats->pool_gets[pool], 1);
+	}
+}
 
-									//regular file, probably want to be read and write
-									stbuf->st_mode = S_IFREG | 0666;
-									stbuf->st_nlink = 1; //file links
-									stbuf->st_size = entry.files[file_start].fsize; //file size - make sure you replace with real size!
-									res = 0; // no error
-								}
-							}
-						}
-					}
-				}
-			}
+//hit is 1 when a block was shared, 0 when it had to be written
+static void stats_dedup(int hit) {
 
-			else {
-				res = -1;
-			}
+	struct cs1550_stats *stats = stats_local();
 
-			fclose(file);
-		}
+	if (stats) {
+		stats_add(hit ? &stats->dedup_hits : &stats->dedup_stored, 1);
+	}
+}
 
-		else {
-			//Else return that path doesn't exist
-			res = -ENOENT;
-		}
+//One file moved into a single run of blocks
+static void stats_defrag(long blocks) {
+
+	struct cs1550_stats *stats = stats_local();
+
+	if (stats) {
+
+		stats_add(&stats->defrag_files, 1);
+		stats_add(&stats->defrag_blocks, blocks);
 	}
+}
 
-	return res;
+//hit is 1 when a file's attributes were cached, 0 when they were read in
+static void stats_xattr(int hit) {
+
+	struct cs1550_stats *stats = stats_local();
+
+	if (stats) {
+		stats_add(hit ? &stats->xattr_hits : &stats->xattr_misses, 1);
+	}
 }
 
-//////////////////////////////////////////////////////////////////////////
-/////////////////////////// SECTION COMPLETE /////////////////////////////
-//////////////////////////////////////////////////////////////////////////
+//found is 1 for a cached entry, 0 for a name cached as missing, -1 when the
+//directory had to be read
+static void stats_dentry(int found) {
 
-/*
- * Called whenever the contents of a directory are desired. Could be from an 'ls'
- * or could even be when a user hits TAB to do autocompletion
- */
+	struct cs1550_stats *stats = stats_local();
 
-static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	if (stats) {
+		stats_add(found > 0 ? &stats->dentry_hits : found == 0 ? &stats->dentry_negative_hits : &stats->dentry_misses, 1);
+	}
+}
 
-	//Since we're building with -Wall (all warnings reported) we need
-	//to "use" every parameter, so let's just cast them to void to
-	//satisfy the compiler
-	(void) offset;
-	(void) fi;
+//One batch handed to the disk with requests in flight together
+static void stats_batch(uint64_t requests) {
 
-	int directory_files, index;
-	int res = -ENOENT;
-	long directory_location = -1;
+	struct cs1550_stats *stats = stats_local();
 
-	cs1550_root_directory root;
-	cs1550_directory_entry entry;
+	if (stats) {
+		stats_add(&stats->io_batches, 1);
+		stats_add(&stats->io_requests, requests);
+	}
+}
 
-	FILE *file;
+//Sums every thread's counters into total
+static void stats_collect(struct cs1550_stats *total) {
 
-	char extension[MAX_EXTENSION + 1];
-	char directory[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
+	struct cs1550_stats *stats;
+	int operation, bucket;
 
-	memset(extension, 0, MAX_EXTENSION + 1);
-	memset(directory, 0, MAX_FILENAME + 1);
-	memset(filename, 0, MAX_FILENAME + 1);
+	memset(total, 0, sizeof(struct cs1550_stats));
 
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	for (stats = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE); stats; stats = stats->next) {
 
-	char temporary[MAX_EXTENSION + MAX_FILENAME + 2];
+		for (operation = 0; operation < OP_COUNT; operation++) {
 
-	//the filler function allows us to add entries to the listing
-	//read the fuse.h file for a description (in the ../include dir)
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+			total->calls[operation] += __atomic_load_n(&stats->calls[operation], __ATOMIC_RELAXED);
+			total->errors[operation] += __atomic_load_n(&stats->errors[operation], __ATOMIC_RELAXED);
+			total->nanoseconds[operation] += __atomic_load_n(&stats->nanoseconds[operation], __ATOMIC_RELAXED);
 
-	//This line assumes we have no subdirectories, need to change
-	if (strcmp(path, "/") != 0) {
-		if (directory[0] && directory[MAX_FILENAME] == '\0' && extension[MAX_EXTENSION] == '\0' && filename[MAX_FILENAME] == '\0') {
+			for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+				total->latency[operation][bucket] += __atomic_load_n(&stats->latency[operation][bucket], __ATOMIC_RELAXED);
+			}
+		}
 
-			file = fopen(".disk", "rb");
+		total->file_bytes_read += __atomic_load_n(&stats->file_bytes_read, __ATOMIC_RELAXED);
+		total->file_bytes_written += __atomic_load_n(&stats->file_bytes_written, __ATOMIC_RELAXED);
+		total->blocks_read += __atomic_load_n(&stats->blocks_read, __ATOMIC_RELAXED);
+		total->blocks_written += __atomic_load_n(&stats->blocks_written, __ATOMIC_RELAXED);
+		total->bytes_read += __atomic_load_n(&stats->bytes_read, __ATOMIC_RELAXED);
+		total->bytes_written += __atomic_load_n(&stats->bytes_written, __ATOMIC_RELAXED);
+		total->cache_hits += __atomic_load_n(&stats->cache_hits, __ATOMIC_RELAXED);
+		total->cache_misses += __atomic_load_n(&stats->cache_misses, __ATOMIC_RELAXED);
+		total->compress_in += __atomic_load_n(&stats->compress_in, __ATOMIC_RELAXED);
+		total->compress_out += __atomic_load_n(&stats->compress_out, __ATOMIC_RELAXED);
+		total->dedup_hits += __atomic_load_n(&stats->dedup_hits, __ATOMIC_RELAXED);
+		total->dedup_stored += __atomic_load_n(&stats->dedup_stored, __ATOMIC_RELAXED);
+		total->io_batches += __atomic_load_n(&stats->io_batches, __ATOMIC_RELAXED);
+		total->io_requests += __atomic_load_n(&stats->io_requests, __ATOMIC_RELAXED);
+		total->checksum_bytes += __atomic_load_n(&stats->checksum_bytes, __ATOMIC_RELAXED);
+		total->checksum_nanoseconds += __atomic_load_n(&stats->checksum_nanoseconds, __ATOMIC_RELAXED);
+		total->checksum_errors += __atomic_load_n(&stats->checksum_errors, __ATOMIC_RELAXED);
+		total->dentry_hits += __atomic_load_n(&stats->dentry_hits, __ATOMIC_RELAXED);
+		total->dentry_negative_hits += __atomic_load_n(&stats->dentry_negative_hits, __ATOMIC_RELAXED);
+		total->dentry_misses += __atomic_load_n(&stats->dentry_misses, __ATOMIC_RELAXED);
+		total->defrag_files += __atomic_load_n(&stats->defrag_files, __ATOMIC_RELAXED);
+		total->defrag_blocks += __atomic_load_n(&stats->defrag_blocks, __ATOMIC_RELAXED);
+		total->xattr_hits += __atomic_load_n(&stats->xattr_hits, __ATOMIC_RELAXED);
+		total->xattr_misses += __atomic_load_n(&stats->xattr_misses, __ATOMIC_RELAXED);
+
+		for (operation = 0; operation < POOL_COUNT; operation++) {
+
+			total->pool_gets[operation] += __atomic_load_n(&stats->pool_gets[operation], __ATOMIC_RELAXED);
+			total->pool_refills[operation] += __atomic_load_n(&stats->pool_refills[operation], __ATOMIC_RELAXED);
+		}
+	}
+}
 
-			directory_location = directory_offset(file, directory);
+static void refcount_totals(long *blocks, long *refs);
+static const char *io_backend(void);
+static void pools_print(FILE *out, struct cs1550_stats *total);
+static void defrag_print(FILE *out);
+static const char *crc32c_name;
 
-			if (directory_location) {
-				if (fseek(file, directory_location * BLOCK_SIZE, SEEK_SET) == 0) {
-					if (fread(&file, 1, BLOCK_SIZE, file) == BLOCK_SIZE) {
+static void stats_print(FILE *out) {
 
-						directory_files = entry.nFiles;
+	struct cs1550_stats total;
+	uint64_t lookups;
+	long shared_blocks, shared_refs;
+	int operation, bucket;
 
-						for (index = 0; index < directory_files; index++) {
+	stats_collect(&total);
+	refcount_totals(&shared_blocks, &shared_refs);
 
-							strcpy(temporary, entry.files[index].fname);
+	fprintf(out, "%-10s %12s %12s %12s\n", "operation", "calls", "errors", "avg_ns");
 
-							if (entry.files[index].fext[0]) {
+	for (operation = 0; operation < OP_COUNT; operation++) {
 
-								strcat(temporary, ".");
-								strcat(temporary, entry.files[index].fext);
-							}
+		uint64_t calls = total.calls[operation];
 
-							filler(buf, temporary, NULL, 0);
-						}
+		fprintf(out, "%-10s %12llu %12llu %12llu\n", operation_names[operation],
+			(unsigned long long) calls,
+			(unsigned long long) total.errors[operation],
+			(unsigned long long) (calls ? total.nanoseconds[operation] / calls : 0));
+	}
 
-						res = 0;
-					}
-				}
-			}
+	fprintf(out, "\nlatency_ns\n");
 
-			fclose(file);
-		}
+	for (operation = 0; operation < OP_COUNT; operation++) {
 
-		else {
-			return -ENOENT;
+		if (total.calls[operation] == 0) {
+			continue;
 		}
-	}
 
-	else {
+		fprintf(out, "%s\n", operation_names[operation]);
 
-		file = fopen(".disk", "rb");
+		for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
 
-		if (file && (fread(&root, 1, BLOCK_SIZE, file) == BLOCK_SIZE)) {
+			if (total.latency[operation][bucket]) {
 
-			int directories = root.nDirectories;
+				if (bucket == STATS_BUCKETS - 1) {
+					fprintf(out, "  >= %llu", 1ULL << (bucket - 1));
+				}
 
-			for (index = 0; index < directories; index++) {
-				filler(buf, root.directories[index].dname, NULL, 0);
-			}
+				else {
+					fprintf(out, "  < %llu", 1ULL << bucket);
+				}
 
-			res = 0;
+				fprintf(out, " %llu\n", (unsigned long long) total.latency[operation][bucket]);
+			}
 		}
-
-		fclose(file);
 	}
 
-	/*
-	//add the user stuff (subdirs or files)
-	//the +1 skips the leading '/' on the filenames
-	filler(buf, newpath + 1, NULL, 0);
-	*/
-	return res;
+	lookups = total.cache_hits + total.cache_misses;
+
+	fprintf(out, "\nfile_bytes_read %llu\n", (unsigned long long) total.file_bytes_read);
+	fprintf(out, "file_bytes_written %llu\n", (unsigned long long) total.file_bytes_written);
+	fprintf(out, "blocks_read %llu\n", (unsigned long long) total.blocks_read);
+	fprintf(out, "blocks_written %llu\n", (unsigned long long) total.blocks_written);
+	fprintf(out, "bytes_read %llu\n", (unsigned long long) total.bytes_read);
+	fprintf(out, "bytes_written %llu\n", (unsigned long long) total.bytes_written);
+	fprintf(out, "cache_hits %llu\n", (unsigned long long) total.cache_hits);
+	fprintf(out, "cache_misses %llu\n", (unsigned long long) total.cache_misses);
+	fprintf(out, "cache_hit_rate %.2f%%\n", lookups ? 100.0 * total.cache_hits / lookups : 0.0);
+	fprintf(out, "compress_bytes_in %llu\n", (unsigned long long) total.compress_in);
+	fprintf(out, "compress_bytes_out %llu\n", (unsigned long long) total.compress_out);
+	fprintf(out, "compress_ratio %.2f\n", total.compress_out ? (double) total.compress_in / total.compress_out : 0.0);
+	fprintf(out, "dedup_hits %llu\n", (unsigned long long) total.dedup_hits);
+	fprintf(out, "dedup_stored %llu\n", (unsigned long long) total.dedup_stored);
+	fprintf(out, "dedup_ratio %.2f\n", total.dedup_stored ? (double) (total.dedup_hits + total.dedup_stored) / total.dedup_stored : 0.0);
+	fprintf(out, "shared_blocks %ld\n", shared_blocks);
+	fprintf(out, "shared_extra_refs %ld\n", shared_refs);
+	fprintf(out, "io_backend %s\n", io_backend());
+	fprintf(out, "io_batches %llu\n", (unsigned long long) total.io_batches);
+	fprintf(out, "io_requests %llu\n", (unsigned long long) total.io_requests);
+	fprintf(out, "io_queue_depth %.2f\n", total.io_batches ? (double) total.io_requests / total.io_batches : 0.0);
+
+	fprintf(out, "checksum_impl %s\n", crc32c_name);
+	fprintf(out, "checksum_bytes %llu\n", (unsigned long long) total.checksum_bytes);
+	fprintf(out, "checksum_mb_per_s %.1f\n", total.checksum_nanoseconds ? total.checksum_bytes * 1000.0 / total.checksum_nanoseconds : 0.0);
+	fprintf(out, "checksum_errors %llu\n", (unsigned long long) total.checksum_errors);
+	fprintf(out, "dentry_hits %llu\n", (unsigned long long) total.dentry_hits);
+	fprintf(out, "dentry_negative_hits %llu\n", (unsigned long long) total.dentry_negative_hits);
+	fprintf(out, "dentry_misses %llu\n", (unsigned long long) total.dentry_misses);
+	fprintf(out, "defrag_files %llu\n", (unsigned long long) total.defrag_files);
+	fprintf(out, "defrag_blocks %llu\n", (unsigned long long) total.defrag_blocks);
+	fprintf(out, "xattr_cache_hits %llu\n", (unsigned long long) total.xattr_hits);
+	fprintf(out, "xattr_cache_misses %llu\n", (unsigned long long) total.xattr_misses);
+
+	defrag_print(out);
+
+	pools_print(out, &total);
 }
 
-//////////////////////////////////////////////////////////////////////////
-/////////////////////////// SECTION COMPLETE /////////////////////////////
-//////////////////////////////////////////////////////////////////////////
+//Renders the stats into a freshly allocated buffer the caller must free
+static char *stats_render(size_t *length) {
 
-/*
- * Creates a directory. We can ignore mode since we're not dealing with
- * permissions, as long as getattr returns appropriate ones for us.
- */
+	char *text = NULL;
+	FILE *out = open_memstream(&text, length);
 
-static int cs1550_mkdir(const char *path, mode_t mode) {
+	if (out == NULL) {
+		return NULL;
+	}
 
-	(void) path;
-	(void) mode;
+	stats_print(out);
+	fclose(out);
 
-	int index, directories;
-	long start;
+	return text;
+}
 
-	struct cs1550_bitmap bit_map;
+//The stats file is read-only and its size is whatever it renders to right now
+static int stats_getattr(struct stat *stbuf) {
 
-	cs1550_root_directory root;
-	cs1550_directory_entry entry;
+	size_t length;
+	char *text = stats_render(&length);
 
-	char extension[MAX_EXTENSION + 1];
-	char directory[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
+	if (text == NULL) {
+		return -ENOMEM;
+	}
 
-	unsigned char x = 128;
-	unsigned char map;
+	free(text);
 
-	memset(extension, 0, MAX_EXTENSION + 1);
-	memset(directory, 0, MAX_FILENAME + 1);
-	memset(filename, 0, MAX_FILENAME + 1);
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
+	stbuf->st_size = length;
 
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	return 0;
+}
 
-	FILE *file = fopen(".disk", "r+b");
+static int stats_read(char *buf, size_t size, off_t offset) {
 
-	size_t bytes = 0;
+	size_t length;
+	char *text = stats_render(&length);
 
-	bytes = fread(&root, sizeof(cs1550_root_directory), 1, file);
+	if (text == NULL) {
+		return -ENOMEM;
+	}
 
-	if (filename[0] == '/') {
-		return -EPERM;
+	if (offset >= (off_t) length) {
+		size = 0;
 	}
 
-	if (directory[MAX_FILENAME]) {
-		return -ENAMETOOLONG;
+	else if (offset + size > length) {
+		size = length - offset;
 	}
 
-	if (directory[0] && filename[0] == '\0' && directory[MAX_FILENAME] == '\0') {
+	memcpy(buf, text + offset, size);
+	free(text);
 
-		directories = root.nDirectories;
+	return size;
+}
 
-		for (index = 0; index < directories; index++) {
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
 
-			if (strcmp(directory, root.directories[index].dname) == 0) {
-				return -EEXIST;
-			}
-		}
+//With the trace option every callback is recorded to a trace file: what was
+//called, on what, and how long it took, for the replayer to run again later.
+//Records go into chunks, one per thread at a time, so recording takes no
+//lock. A full chunk is queued for a writer thread and the thread takes an
+//empty one. The chunks are a fixed ring: if the writer falls that far behind
+//records are dropped and counted rather than slowing the callbacks down.
+#define TRACE_MAGIC 0x3145434152545343ULL	//"CSTRACE1" on a little-endian disk
+#define TRACE_CHUNK_SIZE (64 * 1024)
+#define TRACE_CHUNKS 32
+
+//The file starts with this, then holds records in chunk order. Records are
+//only in time order within a thread.
+struct cs1550_trace_header {
+	uint64_t magic;
+	uint64_t blocks;	//size of the traced image
+};
 
-		if (!fseek(file, -BLOCK_SIZE * 5, SEEK_END)) {
+struct cs1550_trace_record {
+	uint64_t start;		//nanoseconds since tracing began
+	uint32_t duration;	//nanoseconds, saturating
+	int32_t result;
+	int64_t offset;
+	int64_t extra;		//another offset or argument the call took
+	uint32_t size;
+	int32_t flags;
+	uint8_t operation;
+	uint16_t path_length;	//the path follows the record
+	uint16_t name_length;	//and then the name, if any
+} __attribute__((packed));
+
+//What a callback was called with, as far as the trace keeps it
+struct cs1550_event {
+	const char *path;
+	const char *name;	//an attribute, or the file a clone shares blocks with
+	int64_t offset;
+	int64_t extra;
+	uint64_t size;
+	int32_t flags;
+};
 
-			fread(&bit_map, 1, BLOCK_SIZE * 5, file);
+#define TRACE(...) ((struct cs1550_event) { __VA_ARGS__ })
 
-			start = 0;
+struct cs1550_trace_chunk {
+	size_t used;
+	struct cs1550_trace_chunk *next;
+	char data[TRACE_CHUNK_SIZE];
+};
 
-			for (index = 1; index < END_OF_BITMAP; index++) {
+static struct cs1550_trace {
+	int fd;		//-1 when not tracing
+	uint64_t epoch;
+	unsigned generation;	//bumped each time tracing starts
+	struct cs1550_trace_chunk *chunks;
+	struct cs1550_trace_chunk *empty;
+	struct cs1550_trace_chunk *queued;	//full chunks, oldest first
+	struct cs1550_trace_chunk **last;
+	uint64_t dropped;
+	pthread_t writer;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+} trace = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
 
-				if (bit_map.bitmap[index] < 255) {
+static __thread struct cs1550_trace_chunk *trace_chunk;
+static __thread unsigned trace_generation;
 
-					map = bit_map.bitmap[index] + 1;
+//Queues chunk, if there is one, and hands back an empty one, null if the
+//ring has none left
+static struct cs1550_trace_chunk *trace_swap(struct cs1550_trace_chunk *chunk) {
 
-					for (start = 7; (map^x) != 0; x>>=1, start--);
+	struct cs1550_trace_chunk *empty;
 
-					start += (index * 8);
+	pthread_mutex_lock(&trace.lock);
 
-					bit_map.bitmap[index] = bit_map.bitmap[index] | map;
+	if (chunk) {
 
-					fwrite(&bit_map, 1, BLOCK_SIZE * 5, file);
+		chunk->next = NULL;
+		*trace.last = chunk;
+		trace.last = &chunk->next;
 
-					break;
-				}
-			}
+		pthread_cond_signal(&trace.wake);
+	}
 
-			if (start != 0) {
+	if ((empty = trace.empty)) {
+		trace.empty = empty->next;
+	}
 
-				fseek(file, 0, SEEK_SET);
-				fread(&root, 1, BLOCK_SIZE, file);
+	pthread_mutex_unlock(&trace.lock);
 
-				root.directories[root.nDirectories].nStartBlock = start;
+	return empty;
+}
 
-				strcpy(root.directories[root.nDirectories].dname, directory);
+static void trace_record(enum cs1550_operation operation, uint64_t start, int res, const struct cs1550_event *event) {
 
-				root.nDirectories++;
+	struct cs1550_trace_record record;
+	uint64_t elapsed = stats_now() - start;
+	const char *path = event->path ? event->path : "";
+	const char *name = event->name ? event->name : "";
+	size_t path_length = strnlen(path, UINT16_MAX);
+	size_t name_length = strnlen(name, UINT16_MAX);
+	size_t length = sizeof(record) + path_length + name_length;
+	struct cs1550_trace_chunk *chunk;
 
-				fseek(file, 0, SEEK_SET);
-				fwrite(&root, 1, BLOCK_SIZE, file);
+	if (trace_generation != trace.generation) {
 
-				fseek(file, start * BLOCK_SIZE, SEEK_SET);
-				fwrite(&entry, 1, BLOCK_SIZE, file);
-			}
-		}
+		trace_chunk = NULL;
+		trace_generation = trace.generation;
 	}
 
-	fclose(file);
-	return 0;
-}
+	chunk = trace_chunk;
 
-//////////////////////////////////////////////////////////////////////////
-/////////////////////////// SECTION COMPLETE /////////////////////////////
-//////////////////////////////////////////////////////////////////////////
+	if (chunk == NULL || chunk->used + length > TRACE_CHUNK_SIZE) {
+		chunk = trace_chunk = trace_swap(chunk);
+	}
 
+	if (chunk == NULL) {
 
-/*
- * Removes a directory.
- */
+		__atomic_add_fetch(&trace.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
 
-static int cs1550_rmdir(const char *path)
-{
-	(void) path;
-    return 0;
+	record.start = start - trace.epoch;
+	record.duration = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+	record.result = res;
+	record.offset = event->offset;
+	record.extra = event->extra;
+	record.size = event->size > UINT32_MAX ? UINT32_MAX : event->size;
+	record.flags = event->flags;
+	record.operation = operation;
+	record.path_length = path_length;
+	record.name_length = name_length;
+
+	memcpy(chunk->data + chunk->used, &record, sizeof(record));
+	memcpy(chunk->data + chunk->used + sizeof(record), path, path_length);
+	memcpy(chunk->data + chunk->used + sizeof(record) + path_length, name, name_length);
+
+	chunk->used += length;
 }
 
-//////////////////////////////////////////////////////////////////////////
-//////////////////////////// SECTION COMPLETE ////////////////////////////
-//////////////////////////////////////////////////////////////////////////
+static int trace_write(const void *buffer, size_t length) {
 
+	const char *bytes = buffer;
+	ssize_t done;
 
-/*
- * Does the actual creation of a file. Mode and dev can be ignored.
- *
- */
+	while (length) {
 
-static int cs1550_mknod(const char *path, mode_t mode, dev_t dev) {
+		if ((done = write(trace.fd, bytes, length)) < 0) {
+			return -1;
+		}
 
-	(void) mode;
-	(void) dev;
+		bytes += done;
+		length -= done;
+	}
 
-	int nStartBlock;
-	int res = -1;
-	int count;
-	int flag;
+	return 1;
+}
 
-	long location;
+//Writes full chunks out as they are queued and puts them back in the ring
+static void *trace_writer(void *unused) {
 
-	cs1550_directory_entry entry;
+	(void) unused;
 
-	char extension[MAX_EXTENSION + 1];
-	char directory[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
+	struct cs1550_trace_chunk *chunk;
 
-	memset(extension, 0, MAX_EXTENSION + 1);
-	memset(directory, 0, MAX_FILENAME + 1);
-	memset(filename, 0, MAX_FILENAME + 1);
+	pthread_mutex_lock(&trace.lock);
 
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	for (;;) {
 
-	FILE *file = fopen(".disk", "rb+");
+		while (trace.queued == NULL && !trace.stop) {
+			pthread_cond_wait(&trace.wake, &trace.lock);
+		}
 
-	if (strcmp(path, "/") != 0) {
+		if ((chunk = trace.queued) == NULL) {
+			break;
+		}
 
-		if (directory[MAX_FILENAME]) {
-			res = -ENAMETOOLONG;
+		if ((trace.queued = chunk->next) == NULL) {
+			trace.last = &trace.queued;
 		}
 
-		else if (directory[0] && (directory[MAX_FILENAME] == '\0') && (filename[MAX_FILENAME] == '\0')) {
+		pthread_mutex_unlock(&trace.lock);
+
+		trace_write(chunk->data, chunk->used);
+		chunk->used = 0;
+
+		pthread_mutex_lock(&trace.lock);
+
+		chunk->next = trace.empty;
+		trace.empty = chunk;
+	}
+
+	pthread_mutex_unlock(&trace.lock);
+
+	return NULL;
+}
 
-			if (file) {
+//Starts recording to path, for an image of blocks blocks
+static int trace_start(const char *path, uint64_t blocks) {
 
-				if (fseek(file, BLOCK_SIZE * -5, SEEK_END) == 0) {
+	struct cs1550_trace_header header = { TRACE_MAGIC, blocks };
+	int index;
 
-					nStartBlock = retrieve_block(file);
+	if ((trace.chunks = calloc(TRACE_CHUNKS, sizeof(struct cs1550_trace_chunk))) == NULL) {
+		return -1;
+	}
 
-					location = directory_offset(file, directory);
+	if ((trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 || trace_write(&header, sizeof(header)) != 1) {
 
-					printf("Directory: %s, Directory Location: %d\n", directory, location);
+		if (trace.fd >= 0) {
+			close(trace.fd);
+		}
 
-					if (location) {
-						if (fseek(file, BLOCK_SIZE * location, SEEK_SET) == 0) {
-							if (fread(&entry, 1, BLOCK_SIZE, file) == BLOCK_SIZE) {
+		free(trace.chunks);
+		trace.fd = -1;
 
-								int index;
+		return -1;
+	}
 
-								printf("Directory Located");
+	for (index = 0; index < TRACE_CHUNKS; index++) {
+		trace.chunks[index].next = index + 1 < TRACE_CHUNKS ? &trace.chunks[index + 1] : NULL;
+	}
 
-								count = entry.nFiles;
+	trace.empty = trace.chunks;
+	trace.queued = NULL;
+	trace.last = &trace.queued;
+	trace.dropped = 0;
+	trace.stop = 0;
+	trace.epoch = stats_now();
+	trace.generation++;
 
-								for (index = 0; index < count; index++) {
+	if (pthread_create(&trace.writer, NULL, trace_writer, NULL) != 0) {
 
-									if (strcmp(entry.files[index].fext, extension) == 0 && strcmp(entry.files[index].fname, filename) == 0) {
+		close(trace.fd);
+		free(trace.chunks);
+		trace.fd = -1;
 
-										fclose(file);
-										return -EEXIST;
-									}
-								}
+		return -1;
+	}
 
-								flag = write(file, entry, location, filename, extension, 0, nStartBlock);
+	return 1;
+}
 
-								if (flag < 0) {
-									return -1;
-								}
+//Stops recording once everything recorded is in the file. No callback may
+//be running.
+static void trace_stop(void) {
 
-								cs1550_node new_node;
+	int index;
 
-								new_node.next_node = 0;
-								new_node.value = 0;
+	if (trace.fd < 0) {
+		return;
+	}
 
-								if (fseek(file, nStartBlock * BLOCK_SIZE, SEEK_SET) == 0) {
-									if (fwrite(&new_node, 1, BLOCK_SIZE, file) == BLOCK_SIZE) {
-										res = 0;
-									}
-								}
-							}
-						}
-					}
-				}
-			}
+	pthread_mutex_lock(&trace.lock);
 
-			fclose(file);
+	trace.stop = 1;
+	pthread_cond_signal(&trace.wake);
+
+	pthread_mutex_unlock(&trace.lock);
+
+	pthread_join(trace.writer, NULL);
+
+	//whatever is left is in chunks threads were still filling
+	for (index = 0; index < TRACE_CHUNKS; index++) {
+
+		if (trace.chunks[index].used) {
+			trace_write(trace.chunks[index].data, trace.chunks[index].used);
 		}
 	}
 
-	else {
-		res = -EPERM;
+	if (trace.dropped) {
+		fprintf(stderr, "cs1550: trace dropped %llu records\n", (unsigned long long) trace.dropped);
 	}
 
-	return res;
+	close(trace.fd);
+	free(trace.chunks);
+
+	trace.fd = -1;
+	trace.chunks = NULL;
+	trace.generation++;
 }
 
 //////////////////////////////////////////////////////////////////////////
 /////////////////////////// SECTION COMPLETE /////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-/*
- * Deletes a file
- */
+//Fixed-size objects are carved out of slabs that are never given back until
+//unmount, then recycled through free lists. Each thread keeps a short list of
+//its own so the common get and put touch no shared state; the pool's shared
+//list only ever sees objects moved POOL_BATCH at a time. Objects are rounded
+//up to whole cache lines so two threads never write to the same line.
+#define CACHE_LINE 64
+#define POOL_SLAB_SIZE (64 * 1024)
+#define POOL_BATCH 32
+#define POOL_THREAD_MAX (2 * POOL_BATCH)
+
+struct cs1550_pool_object {
+	struct cs1550_pool_object *next;
+};
 
-static int cs1550_unlink(const char *path) {
+//The first cache line of every slab links it to the pool's other slabs
+struct cs1550_slab {
+	struct cs1550_slab *next;
+};
 
-    (void) path;
+static struct cs1550_pool {
+	const char *name;
+	size_t size;						//object size, asked for
+	size_t stride;						//object size, rounded to cache lines
+
+	pthread_mutex_t lock;				//guards everything below
+	struct cs1550_pool_object *free;	//objects no thread is holding
+	long free_count;
+	struct cs1550_slab *slabs;
+	long slab_count;
+} pools[POOL_COUNT] = {
+	[POOL_BLOCK] = { "block", BLOCK_SIZE, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, 0 },
+};
 
-    return 0;
-}
+static __thread struct cs1550_pool_cache {
+	struct cs1550_pool_object *objects;
+	int count;
+	unsigned generation;	//pool_generation when the objects were taken
+} pool_caches[POOL_COUNT];
+
+//Goes up every time the slabs are freed, which tells every thread that what
+//its cache holds is gone
+static unsigned pool_generation;
+
+//Every pool together may reserve at most this many bytes, 0 for no limit
+static size_t pool_limit;
+static size_t pool_reserved;
+
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//The calling thread's cache, emptied first if the slabs its objects came
+//from have been freed since
+static struct cs1550_pool_cache *pool_cache(enum cs1550_pool_id id) {
+
+	struct cs1550_pool_cache *cache = &pool_caches[id];
+	unsigned generation = __atomic_load_n(&pool_generation, __ATOMIC_ACQUIRE);
+
+	if (cache->generation != generation) {
+
+		cache->objects = NULL;
+		cache->count = 0;
+		cache->generation = generation;
+	}
+
+	return cache;
+}
+
+//Hands count objects from the front of a thread's list back to the pool
+static void pool_return(enum cs1550_pool_id id, int count) {
+
+	struct cs1550_pool *pool = &pools[id];
+	struct cs1550_pool_cache *cache = pool_cache(id);
+	struct cs1550_pool_object *first = cache->objects;
+	struct cs1550_pool_object *last = first;
+	int index;
+
+	if (count <= 0 || first == NULL) {
+		return;
+	}
+
+	for (index = 1; index < count && last->next; index++) {
+		last = last->next;
+	}
+
+	cache->objects = last->next;
+	cache->count -= index;
+
+	pthread_mutex_lock(&pool->lock);
+
+	last->next = pool->free;
+	pool->free = first;
+	pool->free_count += index;
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+//FUSE starts and stops worker threads as load changes, so whatever a thread
+//was holding on to goes back to the pools when it exits
+static void pool_thread_exit(void *unused) {
+
+	int id;
+
+	(void) unused;
+
+	for (id = 0; id < POOL_COUNT; id++) {
+		pool_return(id, pool_cache(id)->count);
+	}
+}
+
+static void pool_key_create(void) {
+
+	pthread_key_create(&pool_key, pool_thread_exit);
+}
+
+//Carves a new slab into objects on the pool's shared list. Must be called
+//with the pool's lock held.
+static int pool_grow(struct cs1550_pool *pool) {
+
+	struct cs1550_slab *slab;
+	size_t offset;
+
+	if (pool->stride == 0) {
+		pool->stride = (pool->size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+	}
+
+	//the slab is counted before it exists, so two pools growing at once
+	//cannot both squeeze under the limit
+	if (__atomic_add_fetch(&pool_reserved, POOL_SLAB_SIZE, __ATOMIC_RELAXED) > pool_limit && pool_limit) {
+
+		__atomic_sub_fetch(&pool_reserved, POOL_SLAB_SIZE, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	if (posix_memalign((void **) &slab, CACHE_LINE, POOL_SLAB_SIZE) != 0) {
+
+		__atomic_sub_fetch(&pool_reserved, POOL_SLAB_SIZE, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	pool->slab_count++;
+
+	for (offset = CACHE_LINE; offset + pool->stride <= POOL_SLAB_SIZE; offset += pool->stride) {
+
+		struct cs1550_pool_object *object = (struct cs1550_pool_object *) ((char *) slab + offset);
+
+		object->next = pool->free;
+		pool->free = object;
+		pool->free_count++;
+	}
+
+	return 1;
+}
+
+//Gets an object, NULL once the pools have reached pool_limit
+static void *pool_get(enum cs1550_pool_id id) {
+
+	struct cs1550_pool *pool = &pools[id];
+	struct cs1550_pool_cache *cache = pool_cache(id);
+	struct cs1550_pool_object *object;
+
+	if (cache->count == 0) {
+
+		pthread_once(&pool_once, pool_key_create);
+		pthread_setspecific(pool_key, cache);
+
+		pthread_mutex_lock(&pool->lock);
+
+		if (pool->free == NULL) {
+			pool_grow(pool);
+		}
+
+		while (pool->free && cache->count < POOL_BATCH) {
+
+			object = pool->free;
+			pool->free = object->next;
+			pool->free_count--;
+
+			object->next = cache->objects;
+			cache->objects = object;
+			cache->count++;
+		}
+
+		pthread_mutex_unlock(&pool->lock);
+
+		stats_pool(id, 1);
+
+		if (cache->count == 0) {
+			return NULL;
+		}
+	}
+
+	object = cache->objects;
+	cache->objects = object->next;
+	cache->count--;
+
+	stats_pool(id, 0);
+
+	return object;
+}
+
+static void pool_put(enum cs1550_pool_id id, void *pointer) {
+
+	struct cs1550_pool_cache *cache = pool_cache(id);
+	struct cs1550_pool_object *object = pointer;
+
+	if (object == NULL) {
+		return;
+	}
+
+	object->next = cache->objects;
+	cache->objects = object;
+	cache->count++;
+
+	if (cache->count > POOL_THREAD_MAX) {
+		pool_return(id, POOL_BATCH);
+	}
+}
+
+//Frees every slab. Only safe once nothing can be holding an object. Other
+//threads' caches still point into the slabs, and throw that away when they
+//see the generation has moved on.
+static void pools_release(void) {
+
+	int id;
+
+	for (id = 0; id < POOL_COUNT; id++) {
+
+		struct cs1550_pool *pool = &pools[id];
+
+		while (pool->slabs) {
+
+			struct cs1550_slab *slab = pool->slabs;
+
+			pool->slabs = slab->next;
+			free(slab);
+		}
+
+		pool->free = NULL;
+		pool->free_count = 0;
+		pool->slab_count = 0;
+	}
+
+	pool_reserved = 0;
+
+	__atomic_add_fetch(&pool_generation, 1, __ATOMIC_RELEASE);
+}
+
+static void pools_print(FILE *out, struct cs1550_stats *total) {
+
+	int id;
+
+	fprintf(out, "pool_reserved_bytes %zu\n", __atomic_load_n(&pool_reserved, __ATOMIC_RELAXED));
+	fprintf(out, "pool_limit_bytes %zu\n", pool_limit);
+
+	for (id = 0; id < POOL_COUNT; id++) {
+
+		struct cs1550_pool *pool = &pools[id];
+		long slabs, shared;
+
+		pthread_mutex_lock(&pool->lock);
+
+		slabs = pool->slab_count;
+		shared = pool->free_count;
+
+		pthread_mutex_unlock(&pool->lock);
+
+		fprintf(out, "pool_%s_slabs %ld\n", pool->name, slabs);
+		fprintf(out, "pool_%s_free_shared %ld\n", pool->name, shared);
+		fprintf(out, "pool_%s_gets %llu\n", pool->name, (unsigned long long) total->pool_gets[id]);
+		fprintf(out, "pool_%s_refills %llu\n", pool->name, (unsigned long long) total->pool_refills[id]);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//Every block's CRC32C is kept in memory while mounted and in a table on disk.
+//0 means the block has no checksum yet and is not verified, so a real CRC of
+//0 is stored as 1 instead.
+#define CHECKSUMS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+
+static struct cs1550_checksums {
+	uint32_t *crcs;			//one per disk block, NULL when there is no table
+	long blocks;			//how many blocks crcs covers
+	long *tables;			//where each table block lives
+	long table_count;
+	unsigned char *dirty;	//one per table block
+	int any_dirty;
+	pthread_mutex_t lock;	//guards dirty, crcs are read and written atomically
+} checksums = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *data, size_t length);
+static const char *crc32c_name = "software";
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//Slicing-by-8: eight bytes per step through eight 256 entry tables
+static uint32_t crc32c_software(uint32_t crc, const unsigned char *data, size_t length) {
+
+	while (length >= 8) {
+
+		uint32_t low, high;
+
+		memcpy(&low, data, 4);
+		memcpy(&high, data + 4, 4);
+
+		low ^= crc;
+
+		crc = crc32c_table[7][low & 0xff] ^ crc32c_table[6][(low >> 8) & 0xff] ^
+			crc32c_table[5][(low >> 16) & 0xff] ^ crc32c_table[4][low >> 24] ^
+			crc32c_table[3][high & 0xff] ^ crc32c_table[2][(high >> 8) & 0xff] ^
+			crc32c_table[1][(high >> 16) & 0xff] ^ crc32c_table[0][high >> 24];
+
+		data += 8;
+		length -= 8;
+	}
+
+	while (length--) {
+		crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+//The SSE4.2 crc32 instruction computes exactly CRC32C, eight bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length) {
+
+	uint64_t value = crc;
+
+	while (length >= 8) {
+
+		uint64_t word;
+
+		memcpy(&word, data, 8);
+		value = _mm_crc32_u64(value, word);
+
+		data += 8;
+		length -= 8;
+	}
+
+	crc = (uint32_t) value;
+
+	while (length--) {
+		crc = _mm_crc32_u8(crc, *data++);
+	}
+
+	return crc;
+}
+#endif
+
+static void crc32c_setup(void) {
+
+	uint32_t index, bit, crc;
+	int slice;
+
+	for (index = 0; index < 256; index++) {
+
+		crc = index;
+
+		for (bit = 0; bit < 8; bit++) {
+			crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		}
+
+		crc32c_table[0][index] = crc;
+	}
+
+	for (index = 0; index < 256; index++) {
+
+		for (slice = 1; slice < 8; slice++) {
+			crc32c_table[slice][index] = (crc32c_table[slice - 1][index] >> 8) ^ crc32c_table[0][crc32c_table[slice - 1][index] & 0xff];
+		}
+	}
+
+	crc32c_update = crc32c_software;
+
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+
+		crc32c_update = crc32c_sse42;
+		crc32c_name = "sse4.2";
+	}
+#endif
+}
+
+static uint32_t block_crc(const void *block) {
+
+	uint32_t crc;
+
+	pthread_once(&crc32c_once, crc32c_setup);
+
+	crc = ~crc32c_update(~0U, block, BLOCK_SIZE);
+
+	return crc ? crc : 1;
+}
+
+//Records the checksums of count blocks just written from buffer
+static void checksum_update(long location, const void *buffer, int count) {
+
+	uint64_t start;
+	int index;
+
+	if (checksums.crcs == NULL) {
+		return;
+	}
+
+	start = stats_now();
+
+	for (index = 0; index < count && location + index < checksums.blocks; index++) {
+
+		long table = (location + index) / CHECKSUMS_PER_BLOCK;
+
+		__atomic_store_n(&checksums.crcs[location + index], block_crc((const char *) buffer + index * BLOCK_SIZE), __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&checksums.lock);
+
+		checksums.dirty[table] = 1;
+		checksums.any_dirty = 1;
+
+		pthread_mutex_unlock(&checksums.lock);
+	}
+
+	stats_checksum(index * BLOCK_SIZE, stats_now() - start, 0);
+}
+
+//Checks count blocks just read into buffer against their checksums
+static int checksum_verify(long location, const void *buffer, int count) {
+
+	uint64_t start;
+	int index, bad = 0;
+
+	if (checksums.crcs == NULL) {
+		return 1;
+	}
+
+	start = stats_now();
+
+	for (index = 0; index < count && location + index < checksums.blocks; index++) {
+
+		uint32_t expected = __atomic_load_n(&checksums.crcs[location + index], __ATOMIC_RELAXED);
+
+		if (expected && expected != block_crc((const char *) buffer + index * BLOCK_SIZE)) {
+
+			fprintf(stderr, "cs1550: checksum mismatch in block %ld\n", location + index);
+			bad++;
+		}
+	}
+
+	stats_checksum(index * BLOCK_SIZE, stats_now() - start, bad);
+
+	return bad ? -1 : 1;
+}
+
+//Forgets the checksums of count blocks a write failed on. Whether they hold
+//the old data or the new is anybody's guess, and 0 is never checked.
+static void checksum_forget(long location, int count) {
+
+	int index;
+
+	if (checksums.crcs == NULL) {
+		return;
+	}
+
+	for (index = 0; index < count && location + index < checksums.blocks; index++) {
+
+		__atomic_store_n(&checksums.crcs[location + index], 0, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&checksums.lock);
+
+		checksums.dirty[(location + index) / CHECKSUMS_PER_BLOCK] = 1;
+		checksums.any_dirty = 1;
+
+		pthread_mutex_unlock(&checksums.lock);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//One request in a batch: count blocks starting at location, read into or
+//written from buffer
+struct cs1550_io {
+	long location;
+	void *buffer;
+	int count;
+	int write;
+};
+
+//How many requests the ring keeps in flight, and the blocks each one can
+//carry. Every request is staged through one of RING_DEPTH registered,
+//page-aligned buffers, which is also what lets the image be opened O_DIRECT.
+#define RING_DEPTH 64
+#define RING_SLOT_BLOCKS 8
+#define RING_SLOT_SIZE (RING_SLOT_BLOCKS * BLOCK_SIZE)
+
+static struct cs1550_ring {
+	int fd;			//the io_uring, -1 when pread/pwrite are used instead
+	int disk;		//our own descriptor for the image, -1 to use the caller's
+	int direct;		//disk was opened O_DIRECT, so buffers must be staged
+	char *slots;	//RING_DEPTH staging buffers of RING_SLOT_SIZE bytes
+
+#ifdef HAVE_IO_URING
+	void *sq_map;
+	void *cq_map;
+	size_t sq_size;
+	size_t cq_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	size_t sqes_size;
+#endif
+
+	pthread_mutex_t lock;	//one batch on the ring at a time
+} ring = { .fd = -1, .disk = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static const char *io_backend(void) {
+
+	if (ring.fd >= 0) {
+		return ring.direct ? "io_uring+O_DIRECT" : "io_uring";
+	}
+
+	return ring.direct ? "pread+O_DIRECT" : "pread";
+}
+
+#ifdef HAVE_IO_URING
+
+static void ring_teardown(void) {
+
+	if (ring.sqes) {
+		munmap(ring.sqes, ring.sqes_size);
+	}
+
+	if (ring.cq_map) {
+		munmap(ring.cq_map, ring.cq_size);
+	}
+
+	if (ring.sq_map) {
+		munmap(ring.sq_map, ring.sq_size);
+	}
+
+	if (ring.fd >= 0) {
+		close(ring.fd);
+	}
+
+	ring.sqes = NULL;
+	ring.cq_map = ring.sq_map = NULL;
+	ring.fd = -1;
+}
+
+//Sets up the ring and registers the image and the staging buffers with it.
+//Any failure leaves ring.fd at -1, which quietly means pread/pwrite.
+static int ring_create(void) {
+
+	struct io_uring_params params;
+	struct iovec buffers[RING_DEPTH];
+	char *sq, *cq;
+	int index;
+
+	memset(&params, 0, sizeof(params));
+
+	ring.fd = syscall(__NR_io_uring_setup, RING_DEPTH, &params);
+
+	if (ring.fd < 0) {
+
+		ring.fd = -1;
+		return -1;
+	}
+
+	ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring.sq_map = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	ring.cq_map = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+
+	if (ring.sq_map == MAP_FAILED || ring.cq_map == MAP_FAILED || ring.sqes == MAP_FAILED) {
+
+		ring.sq_map = ring.sq_map == MAP_FAILED ? NULL : ring.sq_map;
+		ring.cq_map = ring.cq_map == MAP_FAILED ? NULL : ring.cq_map;
+		ring.sqes = ring.sqes == MAP_FAILED ? NULL : ring.sqes;
+
+		ring_teardown();
+		return -1;
+	}
+
+	sq = ring.sq_map;
+	cq = ring.cq_map;
+
+	ring.sq_head = (unsigned *) (sq + params.sq_off.head);
+	ring.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	ring.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) (sq + params.sq_off.array);
+	ring.cq_head = (unsigned *) (cq + params.cq_off.head);
+	ring.cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ring.cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	for (index = 0; index < RING_DEPTH; index++) {
+
+		buffers[index].iov_base = ring.slots + index * RING_SLOT_SIZE;
+		buffers[index].iov_len = RING_SLOT_SIZE;
+	}
+
+	//requests name the image and their buffer by index, which saves the
+	//kernel looking them up and pinning pages on every request
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, buffers, RING_DEPTH) < 0 ||
+		syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, &ring.disk, 1) < 0) {
+
+		ring_teardown();
+		return -1;
+	}
+
+	return 1;
+}
+
+//Waits until one completion is there and returns its result. piece is -1
+//when there was none to wait for.
+static int ring_reap(int *piece) {
+
+	unsigned head = *ring.cq_head;
+	struct io_uring_cqe *cqe;
+	int res;
+
+	*piece = -1;
+
+	while (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+
+		if (syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+			return -errno;
+		}
+	}
+
+	cqe = &ring.cqes[head & *ring.cq_mask];
+
+	*piece = (int) cqe->user_data;
+	res = cqe->res;
+
+	__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return res;
+}
+
+//Gives the ring up for good, so everything from now on uses pread/pwrite.
+//With busy set requests may still be using the slots, so they are left to
+//the kernel and new ones are made.
+static void ring_abandon(int busy) {
+
+	char *slots;
+
+	ring_teardown();
+
+	if (busy && posix_memalign((void **) &slots, 4096, RING_DEPTH * RING_SLOT_SIZE) == 0) {
+		ring.slots = slots;
+	}
+}
+
+//Queues up to RING_DEPTH pieces and waits for all of them. A piece is one
+//request's worth of blocks, staged through the slot with the same index.
+//Returns 0 if the ring itself went wrong, after giving it up.
+static int ring_submit(struct cs1550_io *pieces, int count) {
+
+	unsigned tail = *ring.sq_tail;
+	int index, piece, reaped, res = 1;
+	long submitted;
+
+	for (index = 0; index < count; index++) {
+
+		unsigned slot = tail & *ring.sq_mask;
+		struct io_uring_sqe *sqe = &ring.sqes[slot];
+		char *buffer = ring.slots + index * RING_SLOT_SIZE;
+
+		if (pieces[index].write) {
+			memcpy(buffer, pieces[index].buffer, (size_t) pieces[index].count * BLOCK_SIZE);
+		}
+
+		memset(sqe, 0, sizeof(*sqe));
+
+		sqe->opcode = pieces[index].write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = 0;
+		sqe->addr = (uint64_t) (uintptr_t) buffer;
+		sqe->len = pieces[index].count * BLOCK_SIZE;
+		sqe->off = (uint64_t) pieces[index].location * BLOCK_SIZE;
+		sqe->buf_index = index;
+		sqe->user_data = index;
+
+		ring.sq_array[slot] = slot;
+		tail++;
+	}
+
+	__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+	do {
+		submitted = syscall(__NR_io_uring_enter, ring.fd, count, 0, 0, NULL, 0);
+	} while (submitted < 0 && errno == EINTR);
+
+	//what the kernel didn't take comes back off the queue, so the next
+	//batch doesn't send it along with buffers that are long gone. What did
+	//go in still has to be waited for.
+	if (submitted != count) {
+
+		submitted = submitted < 0 ? 0 : submitted;
+		__atomic_store_n(ring.sq_tail, tail - (unsigned) (count - submitted), __ATOMIC_RELEASE);
+		res = 0;
+	}
+
+	stats_batch(submitted);
+
+	//every completion is reaped here, so none is left for the next batch
+	//to take as one of its own
+	for (reaped = 0; reaped < submitted; reaped++) {
+
+		int done = ring_reap(&piece);
+
+		//a request that failed still has to be reaped, but a ring that
+		//failed to wait has nothing more to give
+		if (piece < 0) {
+			break;
+		}
+
+		if (done != pieces[piece].count * BLOCK_SIZE) {
+			res = res == 1 ? -1 : res;
+		}
+
+		else if (!pieces[piece].write) {
+			memcpy(pieces[piece].buffer, ring.slots + piece * RING_SLOT_SIZE, (size_t) done);
+		}
+	}
+
+	if (res == 0 || reaped < submitted) {
+
+		ring_abandon(reaped < submitted);
+		return 0;
+	}
+
+	return res;
+}
+
+#endif
+
+//Opens the backend for the image. With direct set the image is opened
+//O_DIRECT, and the ring is skipped entirely when use_ring is 0.
+static void ring_setup(const char *path, int direct, int use_ring) {
+
+	if (ring.slots) {
+		return;
+	}
+
+	if (posix_memalign((void **) &ring.slots, 4096, RING_DEPTH * RING_SLOT_SIZE) != 0) {
+
+		ring.slots = NULL;
+		return;
+	}
+
+	if (direct) {
+
+		ring.disk = open(path, O_RDWR | O_DIRECT);
+		ring.direct = ring.disk >= 0;
+
+		//some devices want bigger than 512 byte alignment, and then
+		//the page cache it is
+		if (ring.direct && pread(ring.disk, ring.slots, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+
+			close(ring.disk);
+			ring.disk = -1;
+			ring.direct = 0;
+		}
+	}
+
+#ifdef HAVE_IO_URING
+	if (use_ring) {
+
+		if (ring.disk < 0) {
+			ring.disk = open(path, O_RDWR);
+		}
+
+		if (ring.disk >= 0) {
+			ring_create();
+		}
+	}
+#else
+	(void) use_ring;
+#endif
+}
+
+static void ring_close(void) {
+
+#ifdef HAVE_IO_URING
+	ring_teardown();
+#endif
+
+	if (ring.disk >= 0) {
+		close(ring.disk);
+	}
+
+	free(ring.slots);
+
+	ring.disk = -1;
+	ring.direct = 0;
+	ring.slots = NULL;
+}
+
+//The fallback: one request at a time, staged through an aligned slot when
+//the image is O_DIRECT
+static int sync_io(FILE *file, struct cs1550_io *io) {
+
+	int fd = ring.disk >= 0 ? ring.disk : fileno(file);
+	size_t bytes = (size_t) io->count * BLOCK_SIZE;
+	off_t offset = (off_t) io->location * BLOCK_SIZE;
+	ssize_t done;
+
+	if (!ring.direct) {
+		done = io->write ? pwrite(fd, io->buffer, bytes, offset) : pread(fd, io->buffer, bytes, offset);
+	}
+
+	//the slots only hold so much, so a bigger request is staged in pieces
+	else {
+
+		size_t staged = 0, piece = 0;
+
+		pthread_mutex_lock(&ring.lock);
+
+		for (done = 0; staged < bytes && done == (ssize_t) piece; staged += piece) {
+
+			piece = bytes - staged < RING_DEPTH * RING_SLOT_SIZE ? bytes - staged : RING_DEPTH * RING_SLOT_SIZE;
+
+			if (io->write) {
+				memcpy(ring.slots, (char *) io->buffer + staged, piece);
+				done = pwrite(fd, ring.slots, piece, offset + staged);
+			}
+
+			else if ((done = pread(fd, ring.slots, piece, offset + staged)) == (ssize_t) piece) {
+				memcpy((char *) io->buffer + staged, ring.slots, piece);
+			}
+		}
+
+		pthread_mutex_unlock(&ring.lock);
+
+		done = done == (ssize_t) piece ? (ssize_t) staged : -1;
+	}
+
+	return done == (ssize_t) bytes ? 1 : -1;
+}
+
+//Does the I/O for a batch, with no checksumming. The requests in a batch
+//are independent and go to the disk together when the ring is up. Requests
+//bigger than a slot are split into slot-sized pieces, which the ring issues
+//up to RING_DEPTH at a time.
+static int submit_batch(FILE *file, struct cs1550_io *ios, int count) {
+
+	struct cs1550_io pieces[RING_DEPTH];
+	int index, queued = 0, res = 1;
+	int done, length;
+
+	for (index = 0; index < count; index++) {
+
+		if (ios[index].location < 0 || ios[index].count <= 0) {
+			return -1;
+		}
+	}
+
+#ifdef HAVE_IO_URING
+	if (ring.fd >= 0) {
+
+		pthread_mutex_lock(&ring.lock);
+
+		//another batch may have given the ring up while this one waited
+		res = ring.fd >= 0;
+
+		for (index = 0; index < count && res == 1; index++) {
+
+			for (done = 0; done < ios[index].count && res == 1; done += length) {
+
+				length = ios[index].count - done < RING_SLOT_BLOCKS ? ios[index].count - done : RING_SLOT_BLOCKS;
+
+				pieces[queued].location = ios[index].location + done;
+				pieces[queued].buffer = (char *) ios[index].buffer + (size_t) done * BLOCK_SIZE;
+				pieces[queued].count = length;
+				pieces[queued].write = ios[index].write;
+
+				if (++queued == RING_DEPTH) {
+
+					res = ring_submit(pieces, queued);
+					queued = 0;
+				}
+			}
+
+			if (res == 1) {
+				stats_blocks(ios[index].write, ios[index].count);
+			}
+		}
+
+		if (queued && res == 1) {
+			res = ring_submit(pieces, queued);
+		}
+
+		pthread_mutex_unlock(&ring.lock);
+
+		//a ring given up part way leaves the whole batch to be done below
+		if (res != 0) {
+			return res;
+		}
+	}
+#else
+	(void) pieces;
+	(void) queued;
+	(void) done;
+	(void) length;
+#endif
+
+	//without the ring nothing overlaps, so each request is a batch of its
+	//own
+	for (index = 0, res = 1; index < count && res == 1; index++) {
+
+		if ((res = sync_io(file, &ios[index])) == 1) {
+			stats_blocks(ios[index].write, ios[index].count);
+		}
+
+		stats_batch(1);
+	}
+
+	return res;
+}
+
+//A block's data and its checksum change together under the block's stripe
+//lock, held for writing while a batch writes the block and stores its
+//checksum, and for reading while a batch reads it and checks it. So nobody
+//checks a block against a checksum from before or after the data they got.
+#define CHECKSUM_STRIPES 64
+
+static pthread_rwlock_t checksum_stripes[CHECKSUM_STRIPES] = { [0 ... CHECKSUM_STRIPES - 1] = PTHREAD_RWLOCK_INITIALIZER };
+
+//Takes the stripe locks a batch needs, lowest first so two batches never
+//wait on each other, and says which it took in writes and reads
+static void checksum_lock(struct cs1550_io *ios, int count, uint64_t *writes, uint64_t *reads) {
+
+	int index, stripe;
+	long block;
+
+	*writes = *reads = 0;
+
+	if (checksums.crcs == NULL) {
+		return;
+	}
+
+	for (index = 0; index < count; index++) {
+
+		for (block = 0; block < ios[index].count && block < CHECKSUM_STRIPES; block++) {
+
+			uint64_t bit = 1ULL << ((ios[index].location + block) % CHECKSUM_STRIPES);
+
+			*(ios[index].write ? writes : reads) |= bit;
+		}
+	}
+
+	*reads &= ~*writes;
+
+	for (stripe = 0; stripe < CHECKSUM_STRIPES; stripe++) {
+
+		if (*writes & (1ULL << stripe)) {
+			pthread_rwlock_wrlock(&checksum_stripes[stripe]);
+		}
+
+		else if (*reads & (1ULL << stripe)) {
+			pthread_rwlock_rdlock(&checksum_stripes[stripe]);
+		}
+	}
+}
+
+static void checksum_unlock(uint64_t writes, uint64_t reads) {
+
+	int stripe;
+
+	for (stripe = 0; stripe < CHECKSUM_STRIPES; stripe++) {
+
+		if ((writes | reads) & (1ULL << stripe)) {
+			pthread_rwlock_unlock(&checksum_stripes[stripe]);
+		}
+	}
+}
+
+//All disk access goes through here so the block counters see every I/O and
+//every block is checksummed on its way out and verified on its way in
+static int run_batch(FILE *file, struct cs1550_io *ios, int count) {
+
+	uint64_t writes, reads;
+	int index, res;
+
+	checksum_lock(ios, count, &writes, &reads);
+
+	res = submit_batch(file, ios, count);
+
+	//a checksum is only recorded once its block is on disk
+	for (index = 0; index < count; index++) {
+
+		if (ios[index].write && res == 1) {
+			checksum_update(ios[index].location, ios[index].buffer, ios[index].count);
+		}
+
+		else if (ios[index].write) {
+			checksum_forget(ios[index].location, ios[index].count);
+		}
+	}
+
+	for (index = 0; res == 1 && index < count; index++) {
+
+		if (!ios[index].write) {
+			res = checksum_verify(ios[index].location, ios[index].buffer, ios[index].count);
+		}
+	}
+
+	checksum_unlock(writes, reads);
+
+	return res;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//How many blocks the disk has
+static long image_blocks(FILE *file) {
+
+	struct stat buf;
+
+	if (fstat(fileno(file), &buf) == 0) {
+		return buf.st_size / BLOCK_SIZE;
+	}
+
+	return -1;
+}
+
+//Single requests are batches of one. They use positional I/O, so callers
+//never need to seek first.
+static int read_blocks(FILE *file, long location, void *buffer, int count) {
+
+	struct cs1550_io io = { location, buffer, count, 0 };
+
+	return run_batch(file, &io, 1);
+}
+
+static int write_blocks(FILE *file, long location, const void *buffer, int count) {
+
+	struct cs1550_io io = { location, (void *) buffer, count, 1 };
+
+	return run_batch(file, &io, 1);
+}
+
+static int read_block(FILE *file, long location, void *buffer) {
+
+	return read_blocks(file, location, buffer, 1);
+}
+
+static int write_block(FILE *file, long location, const void *buffer) {
+
+	return write_blocks(file, location, buffer, 1);
+}
+
+//Where the mounted tree's root is: block 0 for the live tree, a frozen root
+//when a snapshot is mounted, which also makes the mount read-only
+static long root_location;
+static int read_only;
+
+//Free space, kept in memory as extents of free blocks in two orders: by
+//where they start, to merge neighbours when blocks come back, and by length,
+//to find the smallest extent a request fits in. Built from the bitmap at
+//mount; the bitmap stays the record on disk and is written as blocks are
+//taken and given back. Until it is built, allocation scans the bitmap.
+struct cs1550_extent {
+	long start;
+	long length;
+};
+
+static struct cs1550_freespace {
+	struct cs1550_extent *by_start;
+	struct cs1550_extent *by_length;
+	int count;
+	int capacity;
+	long blocks;	//free blocks in all
+	int loaded;
+} freespace;
+
+static pthread_mutex_t freespace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Where extent would go in by_start
+static int freespace_start_index(long start) {
+
+	int low = 0, high = freespace.count;
+
+	while (low < high) {
+
+		int middle = (low + high) / 2;
+
+		if (freespace.by_start[middle].start < start) {
+			low = middle + 1;
+		}
+
+		else {
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+//Where extent would go in by_length, shorter first and then by start
+static int freespace_length_index(long length, long start) {
+
+	int low = 0, high = freespace.count;
+
+	while (low < high) {
+
+		int middle = (low + high) / 2;
+		struct cs1550_extent *extent = &freespace.by_length[middle];
+
+		if (extent->length < length || (extent->length == length && extent->start < start)) {
+			low = middle + 1;
+		}
+
+		else {
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+static int freespace_insert(long start, long length) {
+
+	int index;
+
+	if (freespace.count == freespace.capacity) {
+
+		int capacity = freespace.capacity ? 2 * freespace.capacity : 64;
+		struct cs1550_extent *by_start = realloc(freespace.by_start, capacity * sizeof(struct cs1550_extent));
+		struct cs1550_extent *by_length;
+
+		if (by_start == NULL) {
+			return -1;
+		}
+
+		freespace.by_start = by_start;
+
+		if ((by_length = realloc(freespace.by_length, capacity * sizeof(struct cs1550_extent))) == NULL) {
+			return -1;
+		}
+
+		freespace.by_length = by_length;
+		freespace.capacity = capacity;
+	}
+
+	index = freespace_start_index(start);
+	memmove(&freespace.by_start[index + 1], &freespace.by_start[index], (freespace.count - index) * sizeof(struct cs1550_extent));
+	freespace.by_start[index].start = start;
+	freespace.by_start[index].length = length;
+
+	index = freespace_length_index(length, start);
+	memmove(&freespace.by_length[index + 1], &freespace.by_length[index], (freespace.count - index) * sizeof(struct cs1550_extent));
+	freespace.by_length[index].start = start;
+	freespace.by_length[index].length = length;
+
+	freespace.count++;
+	freespace.blocks += length;
+
+	return 1;
+}
+
+static void freespace_remove(long start, long length) {
+
+	int index = freespace_start_index(start);
+
+	memmove(&freespace.by_start[index], &freespace.by_start[index + 1], (freespace.count - index - 1) * sizeof(struct cs1550_extent));
+
+	index = freespace_length_index(length, start);
+	memmove(&freespace.by_length[index], &freespace.by_length[index + 1], (freespace.count - index - 1) * sizeof(struct cs1550_extent));
+
+	freespace.count--;
+	freespace.blocks -= length;
+}
+
+//Gives blocks back, merged with the free extents on either side
+static void freespace_add(long start, long length) {
+
+	int index;
+
+	pthread_mutex_lock(&freespace_lock);
+
+	index = freespace_start_index(start);
+
+	if (index < freespace.count && freespace.by_start[index].start == start + length) {
+
+		length += freespace.by_start[index].length;
+		freespace_remove(freespace.by_start[index].start, freespace.by_start[index].length);
+	}
+
+	if (index > 0 && freespace.by_start[index - 1].start + freespace.by_start[index - 1].length == start) {
+
+		struct cs1550_extent before = freespace.by_start[index - 1];
+
+		freespace_remove(before.start, before.length);
+		start = before.start;
+		length += before.length;
+	}
+
+	freespace_insert(start, length);
+
+	pthread_mutex_unlock(&freespace_lock);
+}
+
+//Takes length blocks from the front of the extent at start
+static void freespace_cut(struct cs1550_extent extent, long length) {
+
+	freespace_remove(extent.start, extent.length);
+
+	if (extent.length > length) {
+		freespace_insert(extent.start + length, extent.length - length);
+	}
+}
+
+//Finds count blocks, a run from the smallest extent that holds them all if
+//there is one, otherwise pieces of the largest extents. Set run to insist on
+//a single run. Returns how many it found.
+static int freespace_take(long *blocks, int count, int run) {
+
+	int taken = 0, index;
+
+	pthread_mutex_lock(&freespace_lock);
+
+	index = freespace_length_index(count, 0);
+
+	if (index < freespace.count) {
+
+		struct cs1550_extent extent = freespace.by_length[index];
+
+		for (taken = 0; taken < count; taken++) {
+			blocks[taken] = extent.start + taken;
+		}
+
+		freespace_cut(extent, count);
+	}
+
+	while (!run && taken < count && freespace.count) {
+
+		struct cs1550_extent extent = freespace.by_length[freespace.count - 1];
+		long length = extent.length < count - taken ? extent.length : count - taken;
+		long block;
+
+		for (block = 0; block < length; block++) {
+			blocks[taken++] = extent.start + block;
+		}
+
+		freespace_cut(extent, length);
+	}
+
+	pthread_mutex_unlock(&freespace_lock);
+
+	return taken;
+}
+
+//How much is free and in how many pieces
+static void freespace_totals(long *blocks, int *extents, long *largest) {
+
+	pthread_mutex_lock(&freespace_lock);
+
+	*blocks = freespace.blocks;
+	*extents = freespace.count;
+	*largest = freespace.count ? freespace.by_length[freespace.count - 1].length : 0;
+
+	pthread_mutex_unlock(&freespace_lock);
+}
+
+static void freespace_clear(void) {
+
+	pthread_mutex_lock(&freespace_lock);
+
+	free(freespace.by_start);
+	free(freespace.by_length);
+	memset(&freespace, 0, sizeof(freespace));
+
+	pthread_mutex_unlock(&freespace_lock);
+}
+
+//A disk too big for the old bitmap gets one sized to it: a bitmap block for
+//every BITMAP_SPAN blocks at the end of the disk, with a summary in front of
+//it that has a byte for each bitmap block. The superblock says where both
+//are. Disks the old bitmap can describe keep it, and have their summary
+//worked out at mount from its five blocks.
+#define BITMAP_SPAN (BLOCK_SIZE * 8)
+
+//What the summary says about the blocks one bitmap block covers. A zeroed
+//summary says everything is free, which is right for a zeroed disk.
+#define BITMAP_EMPTY 0
+#define BITMAP_PARTIAL 1
+#define BITMAP_FULL 2
+
+static struct cs1550_layout {
+	long blocks;	//how big the disk was laid out for
+	long bitmap;	//the first bitmap block
+	long count;		//how many bitmap blocks there are
+	long summary;	//the first summary block, 0 when it is only kept in memory
+	long end;		//nothing from here on is handed out
+	long first;		//no bitmap block before this one has a free block
+	unsigned char *state;	//the summary, a BITMAP_ value per bitmap block
+	int loaded;
+} layout;
+
+//Guards the layout, and each bitmap block from being read to being written
+static pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int layout_described(FILE *file, struct cs1550_layout *described);
+
+//The blocks bitmap block index can hand out, from first up to last
+static void bitmap_range(long index, long *first, long *last) {
+
+	*first = index * BITMAP_SPAN < 8 ? 8 : index * BITMAP_SPAN;
+	*first = *first < layout.end ? *first : layout.end;
+	*last = (index + 1) * BITMAP_SPAN < layout.end ? (index + 1) * BITMAP_SPAN : layout.end;
+}
+
+//Whether none, some or all of what a bitmap block covers is taken. One that
+//has nothing to hand out counts as full, so no search ever reads it.
+static int bitmap_state(long index, const unsigned char *bits) {
+
+	long first, last, block;
+	int taken = 0, left = 0;
+
+	bitmap_range(index, &first, &last);
+
+	for (block = first; block < last && !(taken && left); block++) {
+
+		if (bits[block / 8 % BLOCK_SIZE] & (1 << (block % 8))) {
+			taken = 1;
+		}
+
+		else {
+			left = 1;
+		}
+	}
+
+	return !left ? BITMAP_FULL : taken ? BITMAP_PARTIAL : BITMAP_EMPTY;
+}
+
+static void layout_clear(void) {
+
+	pthread_mutex_lock(&bitmap_lock);
+
+	free(layout.state);
+	memset(&layout, 0, sizeof(layout));
+
+	pthread_mutex_unlock(&bitmap_lock);
+}
+
+//Finds the bitmap, and reads its summary, the first time either is needed.
+//Only the summary is read, however big the disk is. Must be called with
+//bitmap_lock held.
+static int layout_load(FILE *file) {
+
+	unsigned char bits[BLOCK_SIZE];
+	long blocks = image_blocks(file);
+	long index, size;
+	int res;
+
+	if (layout.loaded) {
+		return 1;
+	}
+
+	if (blocks <= BITMAP_BLOCKS || (res = layout_described(file, &layout)) < 0) {
+		return -1;
+	}
+
+	if (res == 0) {
+
+		layout.blocks = blocks;
+		layout.bitmap = blocks - BITMAP_BLOCKS;
+		layout.count = BITMAP_BLOCKS;
+		layout.summary = 0;
+		layout.end = layout.bitmap < (long) END_OF_BITMAP * 8 ? layout.bitmap : (long) END_OF_BITMAP * 8;
+	}
+
+	size = (layout.count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	layout.first = 0;
+
+	if ((layout.state = calloc(size, BLOCK_SIZE)) == NULL) {
+		return -1;
+	}
+
+	if (layout.summary && read_blocks(file, layout.summary, layout.state, size) != 1) {
+		res = -1;
+	}
+
+	for (index = 0; !layout.summary && index < layout.count && res >= 0; index++) {
+
+		if (read_block(file, layout.bitmap + index, bits) != 1) {
+			res = -1;
+		}
+
+		layout.state[index] = bitmap_state(index, bits);
+	}
+
+	if (res < 0) {
+
+		free(layout.state);
+		layout.state = NULL;
+
+		return -1;
+	}
+
+	layout.loaded = 1;
+
+	return 1;
+}
+
+//Records what a bitmap block covers, in the summary on disk too if there is
+//one. Must be called with bitmap_lock held.
+static int summary_set(FILE *file, long index, int state) {
+
+	layout.state[index] = state;
+
+	if (state != BITMAP_FULL && index < layout.first) {
+		layout.first = index;
+	}
+
+	if (layout.summary == 0) {
+		return 1;
+	}
+
+	return write_block(file, layout.summary + index / BLOCK_SIZE, layout.state + index / BLOCK_SIZE * BLOCK_SIZE);
+}
+
+//Writes a bitmap block back. The summary says partial, which always gets the
+//block read, before the block changes, and only says empty or full once it
+//has, so it never vouches for bits that are not on disk yet.
+static int bitmap_store(FILE *file, long index, const unsigned char *bits) {
+
+	int state = bitmap_state(index, bits);
+
+	if (state != layout.state[index] && layout.state[index] != BITMAP_PARTIAL && summary_set(file, index, BITMAP_PARTIAL) != 1) {
+		return -1;
+	}
+
+	if (write_block(file, layout.bitmap + index, bits) != 1) {
+		return -1;
+	}
+
+	return state == layout.state[index] ? 1 : summary_set(file, index, state);
+}
+
+//Sets or clears the bits for count blocks, reading and writing a bitmap block
+//once for each stretch of them it covers. Blocks that come free go back into
+//the free-space index. Returns how many bits actually changed, -1 on error.
+//Must be called with bitmap_lock held.
+static int bitmap_change(FILE *file, const long *blocks, int count, int used) {
+
+	unsigned char bits[BLOCK_SIZE];
+	long current = -1;
+	int index, changed = 0;
+
+	for (index = 0; index < count; index++) {
+
+		long block = blocks[index];
+		unsigned char *byte = &bits[block / 8 % BLOCK_SIZE];
+		unsigned char bit = 1 << (block % 8);
+
+		//nothing that is never handed out has a bit to change
+		if (block < 8 || block >= layout.end) {
+			continue;
+		}
+
+		if (block / BITMAP_SPAN != current) {
+
+			if (current >= 0 && bitmap_store(file, current, bits) != 1) {
+				return -1;
+			}
+
+			current = block / BITMAP_SPAN;
+
+			if (read_block(file, layout.bitmap + current, bits) != 1) {
+				return -1;
+			}
+		}
+
+		if (!(*byte & bit) != !used) {
+
+			*byte ^= bit;
+			changed++;
+
+			if (!used && freespace.loaded) {
+				freespace_add(block, 1);
+			}
+		}
+	}
+
+	if (current >= 0 && bitmap_store(file, current, bits) != 1) {
+		return -1;
+	}
+
+	return changed;
+}
+
+static int bitmap_set(FILE *file, const long *blocks, int count, int used) {
+
+	int res;
+
+	pthread_mutex_lock(&bitmap_lock);
+
+	res = layout_load(file) == 1 ? bitmap_change(file, blocks, count, used) : -1;
+
+	pthread_mutex_unlock(&bitmap_lock);
+
+	return res;
+}
+
+//Finds count free blocks, without taking them: a run of consecutive blocks
+//if there is one that long, otherwise the first free ones there are. Bitmap
+//blocks the summary calls full are stepped over and empty ones are not read.
+//Returns how many it found, -1 on error. Must be called with bitmap_lock held.
+static int bitmap_search(FILE *file, long *blocks, int count) {
+
+	unsigned char bits[BLOCK_SIZE];
+	long index, block, first, last, start = 0, run = 0;
+	int found = 0;
+
+	while (layout.first < layout.count && layout.state[layout.first] == BITMAP_FULL) {
+		layout.first++;
+	}
+
+	for (index = layout.first; index < layout.count && run < count; index++) {
+
+		bitmap_range(index, &first, &last);
+
+		if (layout.state[index] == BITMAP_FULL) {
+
+			run = 0;
+			continue;
+		}
+
+		if (layout.state[index] == BITMAP_EMPTY) {
+
+			for (block = first; block < last && found < count; block++) {
+				blocks[found++] = block;
+			}
+
+			start = run ? start : first;
+			run += last - first;
+
+			continue;
+		}
+
+		if (read_block(file, layout.bitmap + index, bits) != 1) {
+			return -1;
+		}
+
+		for (block = first; block < last && run < count; block++) {
+
+			if (bits[block / 8 % BLOCK_SIZE] & (1 << (block % 8))) {
+
+				run = 0;
+				continue;
+			}
+
+			if (run++ == 0) {
+				start = block;
+			}
+
+			if (found < count) {
+				blocks[found++] = block;
+			}
+		}
+	}
+
+	if (run >= count) {
+
+		for (found = 0; found < count; found++) {
+			blocks[found] = start + found;
+		}
+	}
+
+	return found;
+}
+
+//Reads the bitmap into extents. Blocks 0 to 7 are never handed out, and
+//neither is anything from the end of the layout on. Only the bitmap blocks
+//the summary calls partial are read.
+static int freespace_build(FILE *file) {
+
+	unsigned char bits[BLOCK_SIZE];
+	long index, block, first, last, start = -1;
+	int res = 1;
+
+	freespace_clear();
+
+	pthread_mutex_lock(&bitmap_lock);
+
+	if (layout_load(file) != 1) {
+
+		pthread_mutex_unlock(&bitmap_lock);
+		return -1;
+	}
+
+	pthread_mutex_lock(&freespace_lock);
+
+	for (index = 0; index < layout.count; index++) {
+
+		bitmap_range(index, &first, &last);
+
+		if (layout.state[index] == BITMAP_EMPTY) {
+
+			start = start < 0 ? first : start;
+			continue;
+		}
+
+		if (layout.state[index] == BITMAP_FULL) {
+
+			if (start >= 0) {
+				freespace_insert(start, first - start);
+			}
+
+			start = -1;
+			continue;
+		}
+
+		if (read_block(file, layout.bitmap + index, bits) != 1) {
+
+			res = -1;
+			break;
+		}
+
+		for (block = first; block < last; block++) {
+
+			int used = bits[block / 8 % BLOCK_SIZE] & (1 << (block % 8));
+
+			if (!used && start < 0) {
+				start = block;
+			}
+
+			else if (used && start >= 0) {
+
+				freespace_insert(start, block - start);
+				start = -1;
+			}
+		}
+	}
+
+	if (res == 1 && start >= 0) {
+		freespace_insert(start, layout.end - start);
+	}
+
+	freespace.loaded = res == 1;
+
+	pthread_mutex_unlock(&freespace_lock);
+	pthread_mutex_unlock(&bitmap_lock);
+
+	return res;
+}
+
+//Takes count blocks through the free-space index, writing only the bitmap
+//blocks their bits are in
+static int freespace_allocate(FILE *file, long *blocks, int count, int run) {
+
+	int taken = freespace_take(blocks, count, run);
+	int index;
+
+	if (taken > 0 && bitmap_set(file, blocks, taken, 1) < 0) {
+
+		for (index = 0; index < taken; index++) {
+			freespace_add(blocks[index], 1);
+		}
+
+		return -1;
+	}
+
+	return taken;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//Takes count free blocks: a run of consecutive blocks if there is one that
+//long, otherwise the first free ones there are. Returns how many it got, -1
+//on error.
+static int retrieve_blocks(FILE *file, long *blocks, int count) {
+
+	int taken;
+
+	if (freespace.loaded) {
+		return freespace_allocate(file, blocks, count, 0);
+	}
+
+	pthread_mutex_lock(&bitmap_lock);
+
+	taken = layout_load(file) == 1 ? bitmap_search(file, blocks, count) : -1;
+
+	if (taken > 0 && bitmap_change(file, blocks, taken, 1) < 0) {
+		taken = -1;
+	}
+
+	pthread_mutex_unlock(&bitmap_lock);
+
+	return taken;
+}
+
+static long retrieve_block(FILE *file) {
+
+	long taken;
+
+	return retrieve_blocks(file, &taken, 1) == 1 ? taken : -1;
+}
+
+//Gives back blocks taken with retrieve_blocks
+static int free_blocks(FILE *file, const long *blocks, int count) {
+
+	if (count == 0) {
+		return 1;
+	}
+
+	return bitmap_set(file, blocks, count, 0) < 0 ? -1 : 1;
+}
+
+//Clears the block's bit in the bitmap
+static int free_block(FILE *file, long location) {
+
+	return free_blocks(file, &location, 1);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//A name found in a directory, wherever it is stored
+struct cs1550_dentry {
+	int type;			//DT_DIR or DT_REG
+	int root;			//the mounted tree's root, which has no entry of its own
+	long nStartBlock;
+	size_t fsize;
+	long block;			//the directory block holding the entry
+	int offset;			//its slot, or its record's offset, in that block
+};
+
+enum cs1550_dir_format { DIR_ROOT, DIR_FIXED, DIR_DIRENT };
+
+//Steps through the names in a directory: its own blocks, then the chain a
+//fixed-slot directory was extended with
+struct cs1550_cursor {
+	int format;
+	long location;	//the block loaded, -1 once every name has been seen
+	int position;	//the next slot, or the next record's offset
+	long extension;
+	union {
+		cs1550_root_directory root;
+		cs1550_directory_entry fixed;
+		struct cs1550_dirent_block dirent;
+	} block;
+};
+
+//Fills a dirent chain one block at a time
+struct cs1550_builder {
+	long first;		//0 until the first block is taken
+	long location;
+	struct cs1550_dirent_block block;
+};
+
+//Lookups remember what they found, and what they didn't, one component at a
+//time. A directory is known by its first block, which never moves. Each name
+//can sit in any of a few ways of its set, so the components of one path
+//seldom push each other out.
+#define DCACHE_SETS 256
+#define DCACHE_WAYS 4
+
+static struct cs1550_dcache {
+	long parent;
+	int found;				//0 for a name known not to be there
+	int length;				//0 for an empty slot
+	char name[MAX_NAME];
+	struct cs1550_dentry entry;
+} dcache[DCACHE_SETS][DCACHE_WAYS];
+
+static unsigned char dcache_victim[DCACHE_SETS];	//the way to replace next
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void root_entry(struct cs1550_dentry *entry, long location) {
+
+	memset(entry, 0, sizeof(struct cs1550_dentry));
+
+	entry->type = DT_DIR;
+	entry->root = 1;
+	entry->nStartBlock = location;
+}
+
+static int dcache_set(long parent, const char *name, int length) {
+
+	uint32_t hash = 2166136261u ^ (uint32_t) (parent * 0x9e3779b1u);
+	int index;
+
+	for (index = 0; index < length; index++) {
+		hash = (hash ^ (unsigned char) name[index]) * 16777619u;
+	}
+
+	return hash % DCACHE_SETS;
+}
+
+//Where (parent, name) is cached in its set, null if it isn't
+static struct cs1550_dcache *dcache_find(int set, long parent, const char *name, int length) {
+
+	int way;
+
+	for (way = 0; way < DCACHE_WAYS; way++) {
+
+		struct cs1550_dcache *slot = &dcache[set][way];
+
+		if (slot->length == length && slot->parent == parent && memcmp(slot->name, name, length) == 0) {
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+//Returns 1 with entry filled in for a name cached as there, 0 for one cached
+//as missing, -1 when the cache doesn't know
+static int dcache_get(long parent, const char *name, int length, struct cs1550_dentry *entry) {
+
+	struct cs1550_dcache *slot;
+	int res = -1;
+
+	pthread_mutex_lock(&dcache_lock);
+
+	if ((slot = dcache_find(dcache_set(parent, name, length), parent, name, length))) {
+
+		res = slot->found;
+
+		if (res) {
+			*entry = slot->entry;
+		}
+	}
+
+	pthread_mutex_unlock(&dcache_lock);
+
+	stats_dentry(res);
+
+	return res;
+}
+
+//A null entry remembers that the name isn't there
+static void dcache_put(long parent, const char *name, int length, const struct cs1550_dentry *entry) {
+
+	int set = dcache_set(parent, name, length);
+	struct cs1550_dcache *slot;
+	int way;
+
+	pthread_mutex_lock(&dcache_lock);
+
+	slot = dcache_find(set, parent, name, length);
+
+	for (way = 0; !slot && way < DCACHE_WAYS; way++) {
+
+		if (dcache[set][way].length == 0) {
+			slot = &dcache[set][way];
+		}
+	}
+
+	if (!slot) {
+		slot = &dcache[set][dcache_victim[set]++ % DCACHE_WAYS];
+	}
+
+	slot->parent = parent;
+	slot->length = length;
+	slot->found = entry != NULL;
+	memcpy(slot->name, name, length);
+
+	if (entry) {
+		slot->entry = *entry;
+	}
+
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+//Keeps a cached file size in step with the one on disk
+static void dcache_resize(long block, int offset, size_t size) {
+
+	struct cs1550_dcache *slot;
+
+	pthread_mutex_lock(&dcache_lock);
+
+	for (slot = &dcache[0][0]; slot < &dcache[0][0] + DCACHE_SETS * DCACHE_WAYS; slot++) {
+
+		if (slot->length && slot->found && slot->entry.block == block && slot->entry.offset == offset) {
+			slot->entry.fsize = size;
+		}
+	}
+
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+//Remembers the entry at offset in block as missing, once it is taken out
+static void dcache_drop(long block, int offset) {
+
+	struct cs1550_dcache *slot;
+
+	pthread_mutex_lock(&dcache_lock);
+
+	for (slot = &dcache[0][0]; slot < &dcache[0][0] + DCACHE_SETS * DCACHE_WAYS; slot++) {
+
+		if (slot->length && slot->found && slot->entry.block == block && slot->entry.offset == offset) {
+			slot->found = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+//Moves the cached entries past offset in block by delta, after the block was
+//packed together again
+static void dcache_shift(long block, int offset, int delta) {
+
+	struct cs1550_dcache *slot;
+
+	pthread_mutex_lock(&dcache_lock);
+
+	for (slot = &dcache[0][0]; slot < &dcache[0][0] + DCACHE_SETS * DCACHE_WAYS; slot++) {
+
+		if (slot->length && slot->found && slot->entry.block == block && slot->entry.offset > offset) {
+			slot->entry.offset += delta;
+		}
+	}
+
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+//Forgets everything, for when directory blocks are freed and may come back as
+//something else
+static void dcache_flush(void) {
+
+	pthread_mutex_lock(&dcache_lock);
+	memset(dcache, 0, sizeof(dcache));
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static int dir_load(FILE *file, struct cs1550_cursor *cursor, long location, int root) {
+
+	if (read_block(file, location, &cursor->block) != 1) {
+
+		cursor->location = -1;
+		return -1;
+	}
+
+	cursor->location = location;
+	cursor->position = 0;
+
+	if (root) {
+		cursor->format = DIR_ROOT;
+	}
+
+	else if (cursor->block.dirent.magic == DIRENT_MAGIC) {
+		cursor->format = DIR_DIRENT;
+	}
+
+	else {
+		cursor->format = DIR_FIXED;
+	}
+
+	return 1;
+}
+
+static int dir_open(FILE *file, struct cs1550_dentry *dir, struct cs1550_cursor *cursor) {
+
+	cursor->extension = 0;
+
+	return dir_load(file, cursor, dir->nStartBlock, dir->root);
+}
+
+//Fills entry and name with the next name in the directory. Returns 1, 0 once
+//there are no more, -1 on error.
+static int dir_next(FILE *file, struct cs1550_cursor *cursor, struct cs1550_dentry *entry, char *name) {
+
+	while (cursor->location >= 0) {
+
+		int position = cursor->position;
+		long next;
+
+		memset(entry, 0, sizeof(struct cs1550_dentry));
+		entry->block = cursor->location;
+		entry->offset = position;
+
+		if (cursor->format == DIR_ROOT && position < cursor->block.root.nDirectories && position < (int) MAX_DIRS_IN_ROOT) {
+
+			struct cs1550_directory *directory = &cursor->block.root.directories[position];
+
+			cursor->position++;
+
+			if (directory->dname[0] == '\0') {
+
+				cursor->extension = directory->nStartBlock;
+				continue;
+			}
+
+			strncpy(name, directory->dname, MAX_FILENAME);
+			name[MAX_FILENAME] = '\0';
+
+			entry->type = DT_DIR;
+			entry->nStartBlock = directory->nStartBlock;
+
+			return 1;
+		}
+
+		if (cursor->format == DIR_FIXED && position < cursor->block.fixed.nFiles && position < (int) MAX_FILES_IN_DIR) {
+
+			struct cs1550_file_directory *slot = &cursor->block.fixed.files[position];
+
+			cursor->position++;
+
+			if (slot->fname[0] == '\0') {
+
+				cursor->extension = slot->nStartBlock;
+				continue;
+			}
+
+			strncpy(name, slot->fname, MAX_FILENAME);
+			name[MAX_FILENAME] = '\0';
+
+			if (slot->fext[0]) {
+
+				strcat(name, ".");
+				strncat(name, slot->fext, MAX_EXTENSION);
+			}
+
+			entry->type = DT_REG;
+			entry->nStartBlock = slot->nStartBlock;
+			entry->fsize = slot->fsize;
+
+			return 1;
+		}
+
+		if (cursor->format == DIR_DIRENT && position + (int) sizeof(struct cs1550_dirent) <= cursor->block.dirent.used) {
+
+			struct cs1550_dirent record;
+			int end;
+
+			memcpy(&record, cursor->block.dirent.records + position, sizeof(record));
+			end = position + sizeof(record) + record.length;
+
+			if (end <= cursor->block.dirent.used && end <= (int) sizeof(cursor->block.dirent.records)) {
+
+				memcpy(name, cursor->block.dirent.records + position + sizeof(record), record.length);
+				name[record.length] = '\0';
+
+				cursor->position = end;
+
+				entry->type = record.type;
+				entry->nStartBlock = record.nStartBlock;
+				entry->fsize = record.fsize;
+
+				return 1;
+			}
+		}
+
+		//this block is done, so go on along the chain, then into the extension
+		next = cursor->format == DIR_DIRENT ? cursor->block.dirent.nNextBlock : 0;
+
+		if (next == 0) {
+
+			next = cursor->extension;
+			cursor->extension = 0;
+		}
+
+		if (next == 0) {
+			cursor->location = -1;
+		}
+
+		else if (dir_load(file, cursor, next, 0) != 1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void dirent_block_init(struct cs1550_dirent_block *block) {
+
+	memset(block, 0, sizeof(struct cs1550_dirent_block));
+	block->magic = DIRENT_MAGIC;
+}
+
+//Starts the builder on a new block
+static int builder_start(FILE *file, struct cs1550_builder *builder) {
+
+	long location = retrieve_block(file);
+
+	if (location < 0) {
+		return -ENOSPC;
+	}
+
+	if (builder->first == 0) {
+		builder->first = location;
+	}
+
+	else {
+
+		builder->block.nNextBlock = location;
+
+		if (write_block(file, builder->location, &builder->block) != 1) {
+
+			free_block(file, location);
+			builder->block.nNextBlock = 0;
+
+			return -EIO;
+		}
+	}
+
+	builder->location = location;
+	dirent_block_init(&builder->block);
+
+	return 1;
+}
+
+//Adds a record, moving on to a new block once the current one is full. Fills
+//entry, if given, with where the record went.
+static int builder_add(FILE *file, struct cs1550_builder *builder, const char *name, int type, long start, size_t size, struct cs1550_dentry *entry) {
+
+	struct cs1550_dirent record;
+	int length = strlen(name);
+	int res;
+
+	if ((builder->first == 0 || builder->block.used + sizeof(record) + length > sizeof(builder->block.records)) && (res = builder_start(file, builder)) != 1) {
+		return res;
+	}
+
+	record.nStartBlock = start;
+	record.fsize = size;
+	record.type = type;
+	record.length = length;
+
+	memcpy(builder->block.records + builder->block.used, &record, sizeof(record));
+	memcpy(builder->block.records + builder->block.used + sizeof(record), name, length);
+
+	if (entry) {
+
+		memset(entry, 0, sizeof(struct cs1550_dentry));
+
+		entry->type = type;
+		entry->nStartBlock = start;
+		entry->fsize = size;
+		entry->block = builder->location;
+		entry->offset = builder->block.used;
+	}
+
+	builder->block.used += sizeof(record) + length;
+
+	return 1;
+}
+
+//Writes out the block being filled. An empty directory still gets a block.
+static int builder_finish(FILE *file, struct cs1550_builder *builder) {
+
+	int res;
+
+	if (builder->first == 0 && (res = builder_start(file, builder)) != 1) {
+		return res;
+	}
+
+	return write_block(file, builder->location, &builder->block) == 1 ? 1 : -EIO;
+}
+
+//Finds the chain a fixed-slot directory (the one loaded in cursor) was
+//extended with. If it has none yet, one is added when create is set, and 0
+//is returned otherwise.
+static long dir_extension(FILE *file, struct cs1550_cursor *cursor, int create) {
+
+	struct cs1550_builder builder;
+	int index, res;
+
+	if (cursor->format == DIR_ROOT) {
+
+		cs1550_root_directory *root = &cursor->block.root;
+
+		for (index = 0; index < root->nDirectories && index < (int) MAX_DIRS_IN_ROOT; index++) {
+
+			if (root->directories[index].dname[0] == '\0') {
+				return root->directories[index].nStartBlock;
+			}
+		}
+
+		if (create && root->nDirectories >= (int) MAX_DIRS_IN_ROOT) {
+			return -ENOSPC;
+		}
+	}
+
+	else {
+
+		cs1550_directory_entry *fixed = &cursor->block.fixed;
+
+		for (index = 0; index < fixed->nFiles && index < (int) MAX_FILES_IN_DIR; index++) {
+
+			if (fixed->files[index].fname[0] == '\0') {
+				return fixed->files[index].nStartBlock;
+			}
+		}
+
+		if (create && fixed->nFiles >= (int) MAX_FILES_IN_DIR) {
+			return -ENOSPC;
+		}
+	}
+
+	if (!create) {
+		return 0;
+	}
+
+	memset(&builder, 0, sizeof(builder));
+
+	if ((res = builder_finish(file, &builder)) != 1) {
+		return res;
+	}
+
+	if (cursor->format == DIR_ROOT) {
+
+		struct cs1550_directory *slot = &cursor->block.root.directories[cursor->block.root.nDirectories++];
+
+		memset(slot, 0, sizeof(struct cs1550_directory));
+		slot->nStartBlock = builder.first;
+	}
+
+	else {
+
+		struct cs1550_file_directory *slot = &cursor->block.fixed.files[cursor->block.fixed.nFiles++];
+
+		memset(slot, 0, sizeof(struct cs1550_file_directory));
+		slot->nStartBlock = builder.first;
+	}
+
+	if (write_block(file, cursor->location, &cursor->block) != 1) {
+
+		free_block(file, builder.first);
+		return -EIO;
+	}
+
+	return builder.first;
+}
+
+//Looks name up in dir, through the dentry cache
+static int dir_lookup(FILE *file, struct cs1550_dentry *dir, const char *name, int length, struct cs1550_dentry *entry) {
+
+	struct cs1550_cursor cursor;
+	char current[MAX_NAME + 1];
+	int res;
+
+	if ((res = dcache_get(dir->nStartBlock, name, length, entry)) >= 0) {
+		return res ? 1 : -ENOENT;
+	}
+
+	if (dir_open(file, dir, &cursor) != 1) {
+		return -EIO;
+	}
+
+	while ((res = dir_next(file, &cursor, entry, current)) == 1) {
+
+		if ((int) strlen(current) == length && memcmp(current, name, length) == 0) {
+
+			dcache_put(dir->nStartBlock, name, length, entry);
+			return 1;
+		}
+	}
+
+	if (res < 0) {
+		return -EIO;
+	}
+
+	dcache_put(dir->nStartBlock, name, length, NULL);
+
+	return -ENOENT;
+}
+
+//Adds name to dir, filling entry, if given, with where it went
+static int dir_add(FILE *file, struct cs1550_dentry *dir, const char *name, int type, long start, struct cs1550_dentry *entry) {
+
+	struct cs1550_cursor cursor;
+	struct cs1550_builder builder;
+	struct cs1550_dentry added;
+	long chain;
+	int res;
+
+	if (dir_open(file, dir, &cursor) != 1) {
+		return -EIO;
+	}
+
+	chain = cursor.format == DIR_DIRENT ? dir->nStartBlock : dir_extension(file, &cursor, 1);
+
+	if (chain < 0) {
+		return chain;
+	}
+
+	//new names go at the end of the chain
+	builder.first = chain;
+	builder.location = chain;
+
+	if (read_block(file, chain, &builder.block) != 1) {
+		return -EIO;
+	}
+
+	while (builder.block.nNextBlock) {
+
+		builder.location = builder.block.nNextBlock;
+
+		if (read_block(file, builder.location, &builder.block) != 1) {
+			return -EIO;
+		}
+	}
+
+	if ((res = builder_add(file, &builder, name, type, start, 0, &added)) != 1 || (res = builder_finish(file, &builder)) != 1) {
+		return res;
+	}
+
+	dcache_put(dir->nStartBlock, name, strlen(name), &added);
+
+	if (entry) {
+		*entry = added;
+	}
+
+	return 1;
+}
+
+//Updates a file's size where its entry is stored
+static int entry_set_size(FILE *file, struct cs1550_dentry *entry, size_t size) {
+
+	union {
+		cs1550_directory_entry fixed;
+		struct cs1550_dirent_block dirent;
+	} block;
+
+	if (read_block(file, entry->block, &block) != 1) {
+		return -1;
+	}
+
+	if (block.dirent.magic == DIRENT_MAGIC) {
+		memcpy(block.dirent.records + entry->offset + offsetof(struct cs1550_dirent, fsize), &size, sizeof(size));
+	}
+
+	else {
+		block.fixed.files[entry->offset].fsize = size;
+	}
+
+	if (write_block(file, entry->block, &block) != 1) {
+		return -1;
+	}
+
+	entry->fsize = size;
+	dcache_resize(entry->block, entry->offset, size);
+
+	return 1;
+}
+
+//Takes an entry out of its directory block. Dirent blocks are packed back
+//together; in a fixed-slot block, or the root, the last slot moves into the
+//gap.
+static int dir_remove(FILE *file, struct cs1550_dentry *entry) {
+
+	union {
+		cs1550_directory_entry fixed;
+		cs1550_root_directory root;
+		struct cs1550_dirent_block dirent;
+	} block;
+
+	if (read_block(file, entry->block, &block) != 1) {
+		return -EIO;
+	}
+
+	dcache_drop(entry->block, entry->offset);
+
+	if (block.dirent.magic == DIRENT_MAGIC) {
+
+		struct cs1550_dirent record;
+		int size;
+
+		memcpy(&record, block.dirent.records + entry->offset, sizeof(record));
+		size = sizeof(record) + record.length;
+
+		memmove(block.dirent.records + entry->offset, block.dirent.records + entry->offset + size, block.dirent.used - entry->offset - size);
+		block.dirent.used -= size;
+		memset(block.dirent.records + block.dirent.used, 0, size);
+
+		dcache_shift(entry->block, entry->offset, -size);
+	}
+
+	else if (entry->block == root_location) {
+
+		int last = block.root.nDirectories - 1;
+
+		block.root.directories[entry->offset] = block.root.directories[last];
+		memset(&block.root.directories[last], 0, sizeof(block.root.directories[last]));
+		block.root.nDirectories--;
+
+		dcache_shift(entry->block, last - 1, entry->offset - last);
+	}
+
+	else {
+
+		int last = block.fixed.nFiles - 1;
+
+		block.fixed.files[entry->offset] = block.fixed.files[last];
+		memset(&block.fixed.files[last], 0, sizeof(block.fixed.files[last]));
+		block.fixed.nFiles--;
+
+		dcache_shift(entry->block, last - 1, entry->offset - last);
+	}
+
+	return write_block(file, entry->block, &block) == 1 ? 1 : -EIO;
+}
+
+//Resolves the first length bytes of path, one component at a time from the
+//mounted root
+static int walk_length(FILE *file, const char *path, size_t length, struct cs1550_dentry *entry) {
+
+	const char *end = path + length;
+	struct cs1550_dentry child;
+	int res;
+
+	root_entry(entry, root_location);
+
+	while (path < end) {
+
+		size_t component;
+
+		if (*path == '/') {
+
+			path++;
+			continue;
+		}
+
+		component = strcspn(path, "/");
+
+		if (path + component > end) {
+			component = end - path;
+		}
+
+		if (component > MAX_NAME) {
+			return -ENAMETOOLONG;
+		}
+
+		if (entry->type != DT_DIR) {
+			return -ENOTDIR;
+		}
+
+		if ((res = dir_lookup(file, entry, path, component, &child)) != 1) {
+			return res;
+		}
+
+		*entry = child;
+		path += component;
+	}
+
+	return 1;
+}
+
+static int walk(FILE *file, const char *path, struct cs1550_dentry *entry) {
+
+	return walk_length(file, path, strlen(path), entry);
+}
+
+//Resolves the directory a new name at path would go in, and copies the name.
+//Returns 1 when the name is free to use.
+static int walk_new(FILE *file, const char *path, struct cs1550_dentry *parent, char *name) {
+
+	const char *end = path + strlen(path);
+	const char *start;
+	struct cs1550_dentry existing;
+	int res;
+
+	while (end > path && end[-1] == '/') {
+		end--;
+	}
+
+	for (start = end; start > path && start[-1] != '/'; start--);
+
+	//the root itself
+	if (start == end) {
+		return -EEXIST;
+	}
+
+	if (end - start > MAX_NAME) {
+		return -ENAMETOOLONG;
+	}
+
+	memcpy(name, start, end - start);
+	name[end - start] = '\0';
+
+	if ((res = walk_length(file, path, start - path, parent)) != 1) {
+		return res;
+	}
+
+	if (parent->type != DT_DIR) {
+		return -ENOTDIR;
+	}
+
+	res = dir_lookup(file, parent, name, end - start, &existing);
+
+	return res == 1 ? -EEXIST : res == -ENOENT ? 1 : res;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+typedef struct cs1550_disk_block cs1550_disk_block;
+
+//Mount options, filled in by fuse_opt_parse in main
+static struct cs1550_options {
+	int compress;	//compress every file created on this mount
+	int dedup;		//share data blocks with identical contents
+	int odirect;	//open the image O_DIRECT, bypassing the page cache
+	int noring;		//use pread/pwrite even where io_uring is available
+	char *snapshot;	//mount this snapshot, read-only, instead of the live tree
+	unsigned pool_kb;	//cap on the memory the object pools may reserve
+	int checksum;	//give a disk without checksums a checksum table
+	unsigned delay_kb;	//how much written data may wait in memory, 0 to store it at once
+	int defrag;		//move fragmented files into single runs in the background
+	unsigned defrag_kbps;	//how much I/O the defragmenter may do each second
+	char *trace;	//record every callback to this file
+	char *replay;	//replay this trace on a fresh image instead of mounting
+	unsigned replay_threads;	//how many threads the replay runs on
+} options;
+
+#define DELAY_DEFAULT_KB 8192
+#define DEFRAG_DEFAULT_KBPS 1024
+
+static struct fuse_opt cs1550_opts[] = {
+	{ "compress", offsetof(struct cs1550_options, compress), 1 },
+	{ "dedup", offsetof(struct cs1550_options, dedup), 1 },
+	{ "odirect", offsetof(struct cs1550_options, odirect), 1 },
+	{ "noring", offsetof(struct cs1550_options, noring), 1 },
+	{ "snapshot=%s", offsetof(struct cs1550_options, snapshot), 0 },
+	{ "pool_kb=%u", offsetof(struct cs1550_options, pool_kb), 0 },
+	{ "checksum", offsetof(struct cs1550_options, checksum), 1 },
+	{ "delay_kb=%u", offsetof(struct cs1550_options, delay_kb), 0 },
+	{ "defrag", offsetof(struct cs1550_options, defrag), 1 },
+	{ "defrag_kbps=%u", offsetof(struct cs1550_options, defrag_kbps), 0 },
+	{ "trace=%s", offsetof(struct cs1550_options, trace), 0 },
+	{ "replay=%s", offsetof(struct cs1550_options, replay), 0 },
+	{ "replay_threads=%u", offsetof(struct cs1550_options, replay_threads), 0 },
+	FUSE_OPT_END
+};
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//A small LZ4-style codec. Each sequence is a token whose high nibble is the
+//literal count and low nibble the match length minus LZ_MIN_MATCH (15 means
+//more length bytes follow), then the literals, then a little-endian 16 bit
+//offset back into the output. The last sequence is literals only.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t lz_read32(const unsigned char *p) {
+
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+
+	return value;
+}
+
+static int lz_length(unsigned char *out, int op, int capacity, int length) {
+
+	while (length >= 255) {
+
+		if (op >= capacity) {
+			return -1;
+		}
+
+		out[op++] = 255;
+		length -= 255;
+	}
+
+	if (op >= capacity) {
+		return -1;
+	}
+
+	out[op++] = length;
+
+	return op;
+}
+
+//Appends one sequence, returns the new output length or -1 if it won't fit
+static int lz_sequence(unsigned char *out, int op, int capacity, const unsigned char *literals, int count, int offset, int match) {
+
+	int token = op++;
+	int extra = match - LZ_MIN_MATCH;
+
+	if (op > capacity) {
+		return -1;
+	}
+
+	out[token] = (count < 15 ? count : 15) << 4;
+
+	if (count >= 15 && (op = lz_length(out, op, capacity, count - 15)) < 0) {
+		return -1;
+	}
+
+	if (op + count > capacity) {
+		return -1;
+	}
+
+	memcpy(out + op, literals, count);
+	op += count;
+
+	if (match == 0) {
+		return op;
+	}
+
+	if (op + 2 > capacity) {
+		return -1;
+	}
+
+	out[op++] = offset & 0xff;
+	out[op++] = offset >> 8;
+	out[token] |= extra < 15 ? extra : 15;
+
+	if (extra >= 15) {
+		op = lz_length(out, op, capacity, extra - 15);
+	}
+
+	return op;
+}
+
+//Returns the compressed length, or -1 if it would not fit in capacity
+static int lz_compress(const unsigned char *in, int length, unsigned char *out, int capacity) {
+
+	int table[1 << LZ_HASH_BITS];
+	int ip = 0;
+	int anchor = 0;
+	int op = 0;
+
+	memset(table, -1, sizeof(table));
+
+	while (ip + LZ_MIN_MATCH <= length) {
+
+		uint32_t sequence = lz_read32(in + ip);
+		int hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+		int ref = table[hash];
+
+		table[hash] = ip;
+
+		if (ref >= 0 && ip - ref <= LZ_MAX_OFFSET && lz_read32(in + ref) == sequence) {
+
+			int match = LZ_MIN_MATCH;
+
+			while (ip + match < length && in[ref + match] == in[ip + match]) {
+				match++;
+			}
+
+			op = lz_sequence(out, op, capacity, in + anchor, ip - anchor, ip - ref, match);
+
+			if (op < 0) {
+				return -1;
+			}
+
+			ip += match;
+			anchor = ip;
+		}
+
+		else {
+			ip++;
+		}
+	}
+
+	return lz_sequence(out, op, capacity, in + anchor, length - anchor, 0, 0);
+}
+
+//Returns the decompressed length, or -1 if the input is malformed
+static int lz_decompress(const unsigned char *in, int length, unsigned char *out, int capacity) {
+
+	int ip = 0;
+	int op = 0;
+
+	while (ip < length) {
+
+		int token = in[ip++];
+		int count = token >> 4;
+		int match = token & 15;
+		int offset;
+		int more;
+
+		if (count == 15) {
+			do {
+				if (ip >= length) {
+					return -1;
+				}
+
+				more = in[ip++];
+				count += more;
+			} while (more == 255);
+		}
+
+		if (ip + count > length || op + count > capacity) {
+			return -1;
+		}
+
+		memcpy(out + op, in + ip, count);
+		ip += count;
+		op += count;
+
+		//the last sequence carries no match
+		if (ip == length) {
+			break;
+		}
+
+		if (ip + 2 > length) {
+			return -1;
+		}
+
+		offset = in[ip] | (in[ip + 1] << 8);
+		ip += 2;
+
+		if (offset == 0 || offset > op) {
+			return -1;
+		}
+
+		if (match == 15) {
+			do {
+				if (ip >= length) {
+					return -1;
+				}
+
+				more = in[ip++];
+				match += more;
+			} while (more == 255);
+		}
+
+		match += LZ_MIN_MATCH;
+
+		if (op + match > capacity) {
+			return -1;
+		}
+
+		//byte at a time, the match may overlap what it is copying
+		for (; match > 0; match--, op++) {
+			out[op] = out[op - offset];
+		}
+	}
+
+	return op;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//Flags kept in the value field of an index node
+#define NODE_COMPRESSED 1
+#define NODE_INLINE 2
+
+//A file no bigger than this keeps its data in the index node itself, in the
+//space node_pointers would take, and needs no data blocks at all
+#define INLINE_MAX (sizeof(((cs1550_node *) 0)->node_pointers))
+
+//A compressed file is cut into groups of GROUP_SIZE bytes. Each group is
+//stored as an extent: a chain of disk blocks linked through nNextBlock that
+//starts with a header, and node_pointers[n] holds the first block of group n.
+//A group that would not shrink is stored as is, so it never takes more than
+//COMPRESS_GROUP_BLOCKS blocks.
+#define COMPRESS_GROUP_BLOCKS 4
+#define GROUP_SIZE (COMPRESS_GROUP_BLOCKS * MAX_DATA_IN_BLOCK - sizeof(struct cs1550_extent_header))
+
+struct cs1550_extent_header {
+	int stored;	//payload bytes following the header
+	int length;	//bytes the group holds once decompressed
+};
+
+//Recently decompressed groups, keyed by the first block of their extent.
+//Extents are never rewritten in place, so an entry can only go stale when
+//its extent is released, and release_extent drops it then.
+#define GROUP_CACHE_SIZE 16
+
+static struct cs1550_group {
+	long extent;
+	int length;
+	char data[GROUP_SIZE];
+} group_cache[GROUP_CACHE_SIZE];
+
+static pthread_mutex_t group_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Where a file lives, as found by find_file
+struct cs1550_file {
+	struct cs1550_dentry entry;	//where the file is named
+	long location;	//the file's index node
+	size_t size;
+	cs1550_node node;
+};
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//Optional filesystem-wide state, found through the root's nSuperBlock. Images
+//that never needed any of it have no superblock at all.
+#define SUPERBLOCK_MAGIC 0x3035353153435346L
+
+struct cs1550_superblock {
+	long magic;
+	long nRefcounts;	//first block of the refcount table, 0 if none
+	long nSnapshots;	//the snapshot table, 0 if there has never been one
+	long nChecksums;	//first block of the checksum index, 0 if unchecked
+	long nXattrs;		//first block of the xattr table, 0 if none
+	long nBlocks;		//how big the disk was laid out for, 0 for the old bitmap
+	long nBitmap;		//first bitmap block
+	long nBitmapBlocks;	//how many bitmap blocks there are
+	long nSummary;		//first block of the bitmap's summary
+
+	char padding[BLOCK_SIZE - 9 * sizeof(long)];
+};
+
+//A snapshot is a frozen copy of the root, its directory blocks and its index
+//nodes. The data blocks are not copied: the snapshot holds a reference on
+//each, and the live tree copies a shared block before writing to it.
+struct cs1550_snapshot {
+	char name[MAX_FILENAME + 1];	//snapshot name (plus space for nul)
+	long nRoot;						//where the frozen root is on disk
+	long created;					//when it was taken, in seconds
+} __attribute__((packed));
+
+#define MAX_SNAPSHOTS ((BLOCK_SIZE - sizeof(int)) / sizeof(struct cs1550_snapshot))
+
+struct cs1550_snapshot_table {
+	int nSnapshots;
+	struct cs1550_snapshot snapshots[MAX_SNAPSHOTS];
+
+	char padding[BLOCK_SIZE - MAX_SNAPSHOTS * sizeof(struct cs1550_snapshot) - sizeof(int)];
+};
+
+//The control file snapshots are listed in and taken through
+#define SNAPSHOTS_FILE "/.snapshots"
+
+//A block that is shared (by dedup today) has an entry in the refcount table
+//saying how many extra owners it has. Blocks with a single owner have no
+//entry, so images from before sharing existed need no conversion. On disk the
+//table is a chain of disk blocks packed with these pairs.
+struct cs1550_refcount {
+	long block;
+	long count;
+};
+
+#define REFCOUNTS_PER_BLOCK (MAX_DATA_IN_BLOCK / sizeof(struct cs1550_refcount))
+
+//An open addressing hash table from one long to another. Key 0 marks an empty
+//slot, which is fine for block numbers since block 0 is always the root.
+struct cs1550_map {
+	long *keys;
+	long *values;
+	size_t capacity;
+	size_t count;
+};
+
+//Extra owners of shared blocks, loaded from the refcount table on first use
+static struct cs1550_map refcounts;
+static int refcounts_loaded;
+static int refcounts_dirty;
+static pthread_mutex_t refcount_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//The dedup index: data fingerprint to the block holding it, and back again so
+//a block's entry can be dropped when its contents change
+static struct cs1550_map fingerprints;
+static struct cs1550_map block_fingerprints;
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static size_t map_slot(struct cs1550_map *map, long key) {
+
+	size_t slot = ((uint64_t) key * 0x9e3779b97f4a7c15ULL) & (map->capacity - 1);
+
+	while (map->keys[slot] && map->keys[slot] != key) {
+		slot = (slot + 1) & (map->capacity - 1);
+	}
+
+	return slot;
+}
+
+static int map_get(struct cs1550_map *map, long key, long *value) {
+
+	size_t slot;
+
+	if (map->capacity == 0) {
+		return 0;
+	}
+
+	slot = map_slot(map, key);
+
+	if (map->keys[slot] == 0) {
+		return 0;
+	}
+
+	*value = map->values[slot];
+
+	return 1;
+}
+
+static int map_put(struct cs1550_map *map, long key, long value) {
+
+	size_t slot;
+
+	//keep the table at most three quarters full
+	if ((map->count + 1) * 4 > map->capacity * 3) {
+
+		struct cs1550_map bigger;
+		size_t index;
+
+		bigger.capacity = map->capacity ? map->capacity * 2 : 64;
+		bigger.count = map->count;
+		bigger.keys = calloc(bigger.capacity, sizeof(long));
+		bigger.values = calloc(bigger.capacity, sizeof(long));
+
+		if (bigger.keys == NULL || bigger.values == NULL) {
+
+			free(bigger.keys);
+			free(bigger.values);
+			return -1;
+		}
+
+		for (index = 0; index < map->capacity; index++) {
+
+			if (map->keys[index]) {
+
+				slot = map_slot(&bigger, map->keys[index]);
+				bigger.keys[slot] = map->keys[index];
+				bigger.values[slot] = map->values[index];
+			}
+		}
+
+		free(map->keys);
+		free(map->values);
+		*map = bigger;
+	}
+
+	slot = map_slot(map, key);
+
+	if (map->keys[slot] == 0) {
+		map->keys[slot] = key;
+		map->count++;
+	}
+
+	map->values[slot] = value;
+
+	return 1;
+}
+
+static void map_remove(struct cs1550_map *map, long key) {
+
+	size_t slot, next;
+
+	if (map->capacity == 0) {
+		return;
+	}
+
+	slot = map_slot(map, key);
+
+	if (map->keys[slot] == 0) {
+		return;
+	}
+
+	map->keys[slot] = 0;
+	map->count--;
+
+	//pull back any entry that probed past the hole we just made
+	for (next = (slot + 1) & (map->capacity - 1); map->keys[next]; next = (next + 1) & (map->capacity - 1)) {
+
+		size_t home = ((uint64_t) map->keys[next] * 0x9e3779b97f4a7c15ULL) & (map->capacity - 1);
+
+		if ((next > slot && (home <= slot || home > next)) || (next < slot && home <= slot && home > next)) {
+
+			map->keys[slot] = map->keys[next];
+			map->values[slot] = map->values[next];
+			map->keys[next] = 0;
+			slot = next;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//Reads the superblock, making one first if create is set and there is none.
+//Returns its location, or 0 if there is none.
+static long read_superblock(FILE *file, struct cs1550_superblock *super, int create) {
+
+	cs1550_root_directory root;
+	long location;
+
+	if (read_block(file, 0, &root) != 1) {
+		return 0;
+	}
+
+	if (root.nSuperBlock) {
+
+		if (read_block(file, root.nSuperBlock, super) == 1 && super->magic == SUPERBLOCK_MAGIC) {
+			return root.nSuperBlock;
+		}
+
+		return 0;
+	}
+
+	if (!create || (location = retrieve_block(file)) < 0) {
+		return 0;
+	}
+
+	memset(super, 0, sizeof(struct cs1550_superblock));
+	super->magic = SUPERBLOCK_MAGIC;
+
+	if (write_block(file, location, super) != 1) {
+		return 0;
+	}
+
+	root.nSuperBlock = location;
+
+	if (write_block(file, 0, &root) != 1) {
+		return 0;
+	}
+
+	return location;
+}
+
+//Fills in the layout the superblock describes. Returns 0 when it describes
+//none, which leaves the old bitmap, and -1 when it describes more disk than
+//there is.
+static int layout_described(FILE *file, struct cs1550_layout *described) {
+
+	struct cs1550_superblock super;
+
+	if (read_superblock(file, &super, 0) == 0 || super.nBlocks == 0) {
+		return 0;
+	}
+
+	if (super.nBlocks > image_blocks(file)) {
+		return -1;
+	}
+
+	described->blocks = super.nBlocks;
+	described->bitmap = super.nBitmap;
+	described->count = super.nBitmapBlocks;
+	described->summary = super.nSummary;
+	described->end = super.nSummary;
+
+	return 1;
+}
+
+//Gives a disk the old bitmap cannot cover a bitmap sized to it, and its
+//summary, as long as nothing has been taken from the old one yet. Only the
+//summary is written: the new bitmap is past anything the old one handed
+//out, so it is still zero. A disk already in use keeps the bitmap it has.
+static int layout_format(FILE *file) {
+
+	struct cs1550_superblock super;
+	cs1550_root_directory root;
+	unsigned char *state;
+	long index, first, last, count, size, location;
+	int res = 1;
+
+	pthread_mutex_lock(&bitmap_lock);
+
+	if (layout_load(file) != 1) {
+
+		pthread_mutex_unlock(&bitmap_lock);
+		return -1;
+	}
+
+	for (index = 0; index < layout.count && res == 1; index++) {
+
+		if (layout.state[index] != BITMAP_EMPTY) {
+			res = 0;
+		}
+	}
+
+	count = (layout.blocks + BITMAP_SPAN - 1) / BITMAP_SPAN;
+	size = (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	if (res == 0 || layout.summary || layout.end >= layout.bitmap) {
+
+		pthread_mutex_unlock(&bitmap_lock);
+		return 1;
+	}
+
+	if ((state = calloc(size, BLOCK_SIZE)) == NULL) {
+
+		pthread_mutex_unlock(&bitmap_lock);
+		return -1;
+	}
+
+	free(layout.state);
+
+	layout.state = state;
+	layout.count = count;
+	layout.bitmap = layout.blocks - count;
+	layout.summary = layout.bitmap - size;
+	layout.end = layout.summary;
+	layout.first = 0;
+
+	for (index = 0; index < count; index++) {
+
+		bitmap_range(index, &first, &last);
+		layout.state[index] = first < last ? BITMAP_EMPTY : BITMAP_FULL;
+	}
+
+	res = write_blocks(file, layout.summary, layout.state, size);
+
+	memset(&super, 0, sizeof(super));
+
+	super.magic = SUPERBLOCK_MAGIC;
+	super.nBlocks = layout.blocks;
+	super.nBitmap = layout.bitmap;
+	super.nBitmapBlocks = layout.count;
+	super.nSummary = layout.summary;
+
+	pthread_mutex_unlock(&bitmap_lock);
+
+	//the superblock comes out of the new bitmap, and the root only points
+	//at it once it is all there
+	if (res == 1 && (location = retrieve_block(file)) > 0 && write_block(file, location, &super) == 1 && read_block(file, 0, &root) == 1) {
+
+		root.nSuperBlock = location;
+
+		if (write_block(file, 0, &root) == 1) {
+			return 1;
+		}
+	}
+
+	//whatever was done, the disk still says it has the old bitmap
+	layout_clear();
+
+	return -1;
+}
+
+//Reads a chain of pairs, the refcount table's layout, into map
+static void load_pairs(FILE *file, long location, struct cs1550_map *map) {
+
+	struct cs1550_refcount pairs[REFCOUNTS_PER_BLOCK];
+	cs1550_disk_block block;
+	size_t index;
+
+	while (location && read_block(file, location, &block) == 1) {
+
+		memcpy(pairs, block.data, sizeof(pairs));
+
+		for (index = 0; index < REFCOUNTS_PER_BLOCK && pairs[index].block; index++) {
+			map_put(map, pairs[index].block, pairs[index].count);
+		}
+
+		location = block.nNextBlock;
+	}
+}
+
+//Must be called with refcount_lock held
+static void load_refcounts(FILE *file) {
+
+	struct cs1550_superblock super;
+
+	if (refcounts_loaded) {
+		return;
+	}
+
+	if (read_superblock(file, &super, 0)) {
+		load_pairs(file, super.nRefcounts, &refcounts);
+	}
+
+	refcounts_loaded = 1;
+}
+
+//How many owners the block has beyond the first
+static long refcount_get(FILE *file, long location) {
+
+	long count = 0;
+
+	pthread_mutex_lock(&refcount_lock);
+
+	load_refcounts(file);
+	map_get(&refcounts, location, &count);
+
+	pthread_mutex_unlock(&refcount_lock);
+
+	return count;
+}
+
+static void refcount_add(FILE *file, long location, long delta) {
+
+	long count = 0;
+
+	pthread_mutex_lock(&refcount_lock);
+
+	load_refcounts(file);
+	map_get(&refcounts, location, &count);
+
+	if (count + delta > 0) {
+		map_put(&refcounts, location, count + delta);
+	}
+
+	else {
+		map_remove(&refcounts, location);
+	}
+
+	refcounts_dirty = 1;
+
+	pthread_mutex_unlock(&refcount_lock);
+}
+
+//Lays count pairs out over the chain at head, reusing the old chain's blocks,
+//growing or shrinking it as needed and pointing head at the result. If that
+//fails, head and the old chain are left as they were.
+static int write_pairs(FILE *file, long *head, struct cs1550_refcount *pairs, size_t count) {
+
+	size_t needed = (count + REFCOUNTS_PER_BLOCK - 1) / REFCOUNTS_PER_BLOCK;
+	size_t have = 0, reused;
+	size_t index;
+	cs1550_disk_block block;
+	cs1550_disk_block *blocks = NULL;
+	struct cs1550_io *ios = NULL;
+	long location = *head;
+	long *chain = calloc(needed + 1, sizeof(long));
+	int res = 1;
+
+	if (chain == NULL) {
+		return -1;
+	}
+
+	while (location && have < needed && read_block(file, location, &block) == 1) {
+
+		chain[have++] = location;
+		location = block.nNextBlock;
+	}
+
+	//whatever is left of the old chain is only freed once the new one is out
+	reused = have;
+
+	while (have < needed) {
+
+		if ((chain[have] = retrieve_block(file)) < 0) {
+
+			chain[have] = 0;
+			res = -ENOSPC;
+			break;
+		}
+
+		have++;
+	}
+
+	//the table goes out as one batch
+	blocks = calloc(needed + 1, sizeof(cs1550_disk_block));
+	ios = calloc(needed + 1, sizeof(struct cs1550_io));
+
+	if (blocks == NULL || ios == NULL) {
+		res = -1;
+	}
+
+	for (index = 0; res == 1 && index < needed; index++) {
+
+		blocks[index].nNextBlock = chain[index + 1];
+
+		memcpy(blocks[index].data, pairs + index * REFCOUNTS_PER_BLOCK, REFCOUNTS_PER_BLOCK * sizeof(struct cs1550_refcount));
+
+		ios[index].location = chain[index];
+		ios[index].buffer = &blocks[index];
+		ios[index].count = 1;
+		ios[index].write = 1;
+	}
+
+	if (res == 1 && needed) {
+		res = run_batch(file, ios, needed);
+	}
+
+	if (res == 1) {
+
+		*head = chain[0];
+
+		while (location && read_block(file, location, &block) == 1) {
+
+			free_block(file, location);
+			location = block.nNextBlock;
+		}
+	}
+
+	else {
+		free_blocks(file, chain + reused, have - reused);
+	}
+
+	free(blocks);
+	free(ios);
+	free(chain);
+
+	return res;
+}
+
+//Writes a map out as the chain of pairs the superblock field at offset
+//points at, making a superblock first if the map has anything in it
+static int map_sync(FILE *file, struct cs1550_map *map, size_t offset) {
+
+	struct cs1550_superblock super;
+	struct cs1550_refcount *pairs;
+	long location = read_superblock(file, &super, map->count > 0);
+	size_t slot, used = 0;
+	int res = -1;
+
+	//the map is empty and always was, so there is nothing to write
+	if (location == 0 && map->count == 0) {
+		return 1;
+	}
+
+	//padded out to whole blocks, the unused pairs stay zero
+	pairs = calloc(map->count + REFCOUNTS_PER_BLOCK, sizeof(struct cs1550_refcount));
+
+	if (location && pairs) {
+
+		for (slot = 0; slot < map->capacity; slot++) {
+
+			if (map->keys[slot]) {
+
+				pairs[used].block = map->keys[slot];
+				pairs[used].count = map->values[slot];
+				used++;
+			}
+		}
+
+		if (write_pairs(file, (long *) ((char *) &super + offset), pairs, used) == 1 && write_block(file, location, &super) == 1) {
+			res = 1;
+		}
+	}
+
+	free(pairs);
+
+	return res;
+}
+
+//Writes the refcount table back out if it changed
+static int refcount_sync(FILE *file) {
+
+	int res = 1;
+
+	pthread_mutex_lock(&refcount_lock);
+
+	if (refcounts_dirty && (res = map_sync(file, &refcounts, offsetof(struct cs1550_superblock, nRefcounts))) == 1) {
+		refcounts_dirty = 0;
+	}
+
+	pthread_mutex_unlock(&refcount_lock);
+
+	return res;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//Extended attributes. An index node has no bytes to spare, its pointers fill
+//the block, so a file's attributes get an attribute block of their own. The
+//xattr table maps the file's index node (or a directory's first block) to
+//it, and is kept on disk as a chain of pairs like the refcount table. Names
+//and small values are packed into the attribute block. A value bigger than
+//XATTR_INLINE_MAX, or one that no longer fits, is kept in a chain of
+//dedicated value blocks instead.
+#define XATTR_INLINE_MAX 128
+#define XATTR_NAME_MAX 255
+#define XATTR_SIZE_MAX 65536
+
+struct cs1550_xattr {
+	unsigned char length;	//name length, the name follows
+	unsigned int size;		//value length
+	long nStartBlock;		//the value's chain, 0 if the value follows the name
+} __attribute__((packed));
+
+struct cs1550_xattr_block {
+	int used;	//bytes of records in use
+	char records[BLOCK_SIZE - sizeof(int)];
+};
+
+//The attributes of recently used files, kept as their records with every
+//value in line, so getxattr and listxattr on a hot file need no I/O at all
+#define XATTR_CACHE_SIZE 64
+
+static struct cs1550_xattrs {
+	long location;	//the file's index node, 0 for an empty slot
+	size_t length;
+	char *records;
+} xattr_cache[XATTR_CACHE_SIZE];
+
+static struct cs1550_map xattr_table;
+static int xattrs_loaded;
+static int xattrs_dirty;
+static pthread_mutex_t xattr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//The attribute block of the file at location, 0 if it has none.
+//xattr_lock is held for everything from here on.
+static long xattr_block(FILE *file, long location) {
+
+	struct cs1550_superblock super;
+	long block = 0;
+
+	if (!xattrs_loaded) {
+
+		if (read_superblock(file, &super, 0)) {
+			load_pairs(file, super.nXattrs, &xattr_table);
+		}
+
+		xattrs_loaded = 1;
+	}
+
+	map_get(&xattr_table, location, &block);
+
+	return block;
+}
+
+static struct cs1550_xattrs *xattr_slot(long location) {
+	return &xattr_cache[((uint64_t) location * 0x9e3779b97f4a7c15ULL) >> 58];
+}
+
+//Size of a record, with its value in line or not
+static size_t xattr_record_size(struct cs1550_xattr *header, int value) {
+	return sizeof(struct cs1550_xattr) + header->length + (value ? header->size : 0);
+}
+
+static int xattr_read_chain(FILE *file, long location, char *value, size_t size) {
+
+	cs1550_disk_block block;
+	size_t done, length;
+
+	for (done = 0; done < size; done += length) {
+
+		if (location <= 0 || read_block(file, location, &block) != 1) {
+			return -1;
+		}
+
+		length = size - done < MAX_DATA_IN_BLOCK ? size - done : MAX_DATA_IN_BLOCK;
+		memcpy(value + done, block.data, length);
+
+		location = block.nNextBlock;
+	}
+
+	return 1;
+}
+
+//Stores a value in a chain of its own and returns the chain's first block
+static long xattr_write_chain(FILE *file, const char *value, size_t size) {
+
+	int count = (size + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+	long *chain = calloc(count, sizeof(long));
+	cs1550_disk_block *blocks = calloc(count, sizeof(cs1550_disk_block));
+	struct cs1550_io *ios = calloc(count, sizeof(struct cs1550_io));
+	long res = -ENOSPC;
+	int index, taken = 0;
+
+	if (chain && blocks && ios && (taken = retrieve_blocks(file, chain, count)) == count) {
+
+		for (index = 0; index < count; index++) {
+
+			size_t done = (size_t) index * MAX_DATA_IN_BLOCK;
+
+			blocks[index].nNextBlock = index + 1 < count ? chain[index + 1] : 0;
+			memcpy(blocks[index].data, value + done, size - done < MAX_DATA_IN_BLOCK ? size - done : MAX_DATA_IN_BLOCK);
+
+			ios[index].location = chain[index];
+			ios[index].buffer = &blocks[index];
+			ios[index].count = 1;
+			ios[index].write = 1;
+		}
+
+		res = run_batch(file, ios, count) == 1 ? chain[0] : -EIO;
+	}
+
+	if (res < 0 && taken > 0) {
+		free_blocks(file, chain, taken);
+	}
+
+	free(chain);
+	free(blocks);
+	free(ios);
+
+	return res;
+}
+
+static void xattr_free_chain(FILE *file, long location) {
+
+	cs1550_disk_block block;
+
+	while (location > 0 && read_block(file, location, &block) == 1) {
+
+		free_block(file, location);
+		location = block.nNextBlock;
+	}
+}
+
+//The attributes of the file at location, from the cache or read in and
+//cached. Null if they could not be read.
+static struct cs1550_xattrs *xattr_load(FILE *file, long location) {
+
+	struct cs1550_xattrs *slot = xattr_slot(location);
+	struct cs1550_xattr_block block;
+	struct cs1550_xattr header;
+	long where;
+	size_t offset, length = 0;
+	char *records;
+
+	if (slot->location == location && location) {
+
+		stats_xattr(1);
+		return slot;
+	}
+
+	stats_xattr(0);
+
+	block.used = 0;
+
+	if ((where = xattr_block(file, location)) && read_block(file, where, &block) != 1) {
+		return NULL;
+	}
+
+	if (block.used < 0 || block.used > (int) sizeof(block.records)) {
+		return NULL;
+	}
+
+	for (offset = 0; offset < (size_t) block.used; offset += xattr_record_size(&header, header.nStartBlock == 0)) {
+
+		memcpy(&header, block.records + offset, sizeof(header));
+		length += xattr_record_size(&header, 1);
+	}
+
+	if ((records = malloc(length + 1)) == NULL) {
+		return NULL;
+	}
+
+	for (offset = 0, length = 0; offset < (size_t) block.used; offset += xattr_record_size(&header, header.nStartBlock == 0)) {
+
+		memcpy(&header, block.records + offset, sizeof(header));
+		memcpy(records + length, block.records + offset, xattr_record_size(&header, header.nStartBlock == 0));
+
+		if (header.nStartBlock && xattr_read_chain(file, header.nStartBlock, records + length + xattr_record_size(&header, 0), header.size) != 1) {
+
+			free(records);
+			return NULL;
+		}
+
+		length += xattr_record_size(&header, 1);
+	}
+
+	free(slot->records);
+
+	slot->location = location;
+	slot->length = length;
+	slot->records = records;
+
+	return slot;
+}
+
+//Where the named attribute's record starts, -1 if there is none
+static long xattr_find(struct cs1550_xattrs *set, const char *name) {
+
+	struct cs1550_xattr header;
+	size_t offset, length = strlen(name);
+
+	for (offset = 0; offset < set->length; offset += xattr_record_size(&header, 1)) {
+
+		memcpy(&header, set->records + offset, sizeof(header));
+
+		if (header.length == length && memcmp(set->records + offset + sizeof(header), name, length) == 0) {
+			return offset;
+		}
+	}
+
+	return -1;
+}
+
+//Writes records out as the file's attribute block, giving every value that
+//is not kept there a chain of its own, and caches them. Records already
+//stored in a chain stay in it. The cache takes records over on success.
+static int xattr_store(FILE *file, long location, char *records, size_t length) {
+
+	struct cs1550_xattr_block block;
+	struct cs1550_xattr header;
+	struct cs1550_xattrs *slot;
+	long written[sizeof(block.records) / sizeof(header) + 1];
+	long where = xattr_block(file, location);
+	size_t offset, fixed = 0, room;
+	int count = 0, res = 1, index;
+
+	for (offset = 0; offset < length; offset += xattr_record_size(&header, 1)) {
+
+		memcpy(&header, records + offset, sizeof(header));
+		fixed += xattr_record_size(&header, 0);
+	}
+
+	if (fixed > sizeof(block.records)) {
+		return -ENOSPC;
+	}
+
+	memset(&block, 0, sizeof(block));
+	room = sizeof(block.records) - fixed;
+
+	for (offset = 0; res == 1 && offset < length; offset += xattr_record_size(&header, 1)) {
+
+		char *value;
+
+		memcpy(&header, records + offset, sizeof(header));
+		value = records + offset + xattr_record_size(&header, 0);
+
+		if (header.nStartBlock == 0 && (header.size > XATTR_INLINE_MAX || header.size > room)) {
+
+			long chain = xattr_write_chain(file, value, header.size);
+
+			if (chain < 0) {
+
+				res = chain;
+				break;
+			}
+
+			written[count++] = header.nStartBlock = chain;
+			memcpy(records + offset, &header, sizeof(header));
+		}
+
+		memcpy(block.records + block.used, records + offset, xattr_record_size(&header, header.nStartBlock == 0));
+		block.used += xattr_record_size(&header, header.nStartBlock == 0);
+
+		if (header.nStartBlock == 0) {
+			room -= header.size;
+		}
+	}
+
+	//the last attribute gone takes the attribute block with it
+	if (res == 1 && length == 0 && where) {
+
+		free_block(file, where);
+		map_remove(&xattr_table, location);
+		xattrs_dirty = 1;
+	}
+
+	else if (res == 1 && length) {
+
+		if (where == 0 && (where = retrieve_block(file)) < 0) {
+			res = -ENOSPC;
+		}
+
+		else if (write_block(file, where, &block) != 1) {
+			res = -EIO;
+		}
+
+		else if (map_put(&xattr_table, location, where) == 1) {
+			xattrs_dirty = 1;
+		}
+	}
+
+	if (res != 1) {
+
+		for (index = 0; index < count; index++) {
+			xattr_free_chain(file, written[index]);
+		}
+
+		return res;
+	}
+
+	slot = xattr_slot(location);
+
+	if (slot->records != records) {
+		free(slot->records);
+	}
+
+	slot->location = location;
+	slot->length = length;
+	slot->records = records;
+
+	return 1;
+}
+
+//Sets, or with value null removes, one attribute of the file at location
+static int xattr_set(FILE *file, long location, const char *name, const char *value, size_t size, int flags) {
+
+	struct cs1550_xattrs *set;
+	struct cs1550_xattr header;
+	size_t length = strlen(name), before, after, total;
+	long offset, previous = 0;
+	char *records;
+	int res;
+
+	pthread_mutex_lock(&xattr_lock);
+
+	if ((set = xattr_load(file, location)) == NULL) {
+
+		pthread_mutex_unlock(&xattr_lock);
+		return -EIO;
+	}
+
+	offset = xattr_find(set, name);
+
+	if ((offset >= 0 && (flags & XATTR_CREATE)) || (offset < 0 && (value == NULL || (flags & XATTR_REPLACE)))) {
+
+		pthread_mutex_unlock(&xattr_lock);
+		return offset >= 0 ? -EEXIST : -ENODATA;
+	}
+
+	//the new set is the old one with the record swapped, dropped or added
+	before = offset >= 0 ? (size_t) offset : set->length;
+	after = before;
+
+	if (offset >= 0) {
+
+		memcpy(&header, set->records + offset, sizeof(header));
+		previous = header.nStartBlock;
+		after += xattr_record_size(&header, 1);
+	}
+
+	header.length = length;
+	header.size = size;
+	header.nStartBlock = 0;
+
+	total = before + (value ? xattr_record_size(&header, 1) : 0) + set->length - after;
+
+	if ((records = malloc(total + 1)) == NULL) {
+
+		pthread_mutex_unlock(&xattr_lock);
+		return -ENOMEM;
+	}
+
+	memcpy(records, set->records, before);
+
+	if (value) {
+
+		memcpy(records + before, &header, sizeof(header));
+		memcpy(records + before + sizeof(header), name, length);
+		memcpy(records + before + xattr_record_size(&header, 0), value, size);
+	}
+
+	memcpy(records + total - (set->length - after), set->records + after, set->length - after);
+
+	if ((res = xattr_store(file, location, records, total)) == 1) {
+		xattr_free_chain(file, previous);
+	}
+
+	else {
+		free(records);
+	}
+
+	pthread_mutex_unlock(&xattr_lock);
+
+	return res;
+}
+
+//Copies the named value out, returning its size. With size 0 only the size
+//is returned.
+static int xattr_get(FILE *file, long location, const char *name, char *value, size_t size) {
+
+	struct cs1550_xattrs *set;
+	struct cs1550_xattr header;
+	long offset;
+	int res = -EIO;
+
+	pthread_mutex_lock(&xattr_lock);
+
+	if ((set = xattr_load(file, location)) && (offset = xattr_find(set, name)) < 0) {
+		res = -ENODATA;
+	}
+
+	else if (set) {
+
+		memcpy(&header, set->records + offset, sizeof(header));
+		res = header.size;
+
+		if (size && size < header.size) {
+			res = -ERANGE;
+		}
+
+		else if (size) {
+			memcpy(value, set->records + offset + xattr_record_size(&header, 0), header.size);
+		}
+	}
+
+	pthread_mutex_unlock(&xattr_lock);
+
+	return res;
+}
+
+//Lists the attribute names, each followed by a nul, returning the bytes the
+//list takes. With size 0 only the length is returned.
+static int xattr_list(FILE *file, long location, char *list, size_t size) {
+
+	struct cs1550_xattrs *set;
+	struct cs1550_xattr header;
+	size_t offset, used = 0;
+	int res = -EIO;
+
+	pthread_mutex_lock(&xattr_lock);
+
+	if ((set = xattr_load(file, location))) {
+
+		for (offset = 0; offset < set->length; offset += xattr_record_size(&header, 1)) {
+
+			memcpy(&header, set->records + offset, sizeof(header));
+
+			if (size && used + header.length + 1 > size) {
+
+				used = 0;
+				break;
+			}
+
+			if (size) {
+
+				memcpy(list + used, set->records + offset + sizeof(header), header.length);
+				list[used + header.length] = '\0';
+			}
+
+			used += header.length + 1;
+		}
+
+		res = offset < set->length ? -ERANGE : (int) used;
+	}
+
+	pthread_mutex_unlock(&xattr_lock);
+
+	return res;
+}
+
+//Frees every attribute of a file that is going away
+static void xattr_drop(FILE *file, long location) {
+
+	struct cs1550_xattr_block block;
+	struct cs1550_xattr header;
+	struct cs1550_xattrs *slot;
+	long where;
+	size_t offset;
+
+	pthread_mutex_lock(&xattr_lock);
+
+	slot = xattr_slot(location);
+
+	if (slot->location == location) {
+
+		free(slot->records);
+		memset(slot, 0, sizeof(struct cs1550_xattrs));
+	}
+
+	if ((where = xattr_block(file, location)) && read_block(file, where, &block) == 1) {
+
+		for (offset = 0; offset < (size_t) block.used && block.used <= (int) sizeof(block.records); offset += xattr_record_size(&header, header.nStartBlock == 0)) {
+
+			memcpy(&header, block.records + offset, sizeof(header));
+			xattr_free_chain(file, header.nStartBlock);
+		}
+
+		free_block(file, where);
+		map_remove(&xattr_table, location);
+		xattrs_dirty = 1;
+	}
+
+	pthread_mutex_unlock(&xattr_lock);
+}
+
+//Gives the file at to a copy of every attribute of the file at from
+static int xattr_copy(FILE *file, long from, long to) {
+
+	struct cs1550_xattrs *set;
+	struct cs1550_xattr header;
+	size_t offset;
+	char *records;
+	int res = 1;
+
+	pthread_mutex_lock(&xattr_lock);
+
+	if (xattr_block(file, from) == 0) {
+
+		pthread_mutex_unlock(&xattr_lock);
+		return 1;
+	}
+
+	if ((set = xattr_load(file, from)) == NULL || (records = malloc(set->length + 1)) == NULL) {
+
+		pthread_mutex_unlock(&xattr_lock);
+		return -EIO;
+	}
+
+	memcpy(records, set->records, set->length);
+
+	//the copy gets chains of its own
+	for (offset = 0; offset < set->length; offset += xattr_record_size(&header, 1)) {
+
+		memcpy(&header, records + offset, sizeof(header));
+		header.nStartBlock = 0;
+		memcpy(records + offset, &header, sizeof(header));
+	}
+
+	if ((res = xattr_store(file, to, records, set->length)) != 1) {
+		free(records);
+	}
+
+	pthread_mutex_unlock(&xattr_lock);
+
+	return res;
+}
+
+//Writes the xattr table back out if it changed
+static int xattr_sync(FILE *file) {
+
+	int res = 1;
+
+	pthread_mutex_lock(&xattr_lock);
+
+	if (xattrs_dirty && (res = map_sync(file, &xattr_table, offsetof(struct cs1550_superblock, nXattrs))) == 1) {
+		xattrs_dirty = 0;
+	}
+
+	pthread_mutex_unlock(&xattr_lock);
+
+	return res;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//On disk the checksums are packed into table blocks, and the superblock points
+//at a chain of index blocks listing where the table blocks are. Neither kind
+//has a checksum of its own: they are read and written with submit_batch.
+#define CHECKSUM_TABLES_PER_BLOCK (MAX_DATA_IN_BLOCK / sizeof(long))
+
+//The table costs four bytes of memory and of disk for every block, and all of
+//it is read at mount, so a disk bigger than this (32 GiB, a 256 MiB table) is
+//not given one
+#define CHECKSUM_MAX_BLOCKS (1L << 26)
+
+static void checksum_close(void) {
+
+	pthread_mutex_lock(&checksums.lock);
+
+	free(checksums.crcs);
+	free(checksums.tables);
+	free(checksums.dirty);
+
+	checksums.crcs = NULL;
+	checksums.tables = NULL;
+	checksums.dirty = NULL;
+	checksums.blocks = checksums.table_count = 0;
+	checksums.any_dirty = 0;
+
+	pthread_mutex_unlock(&checksums.lock);
+}
+
+//Sizes the in-memory table for the disk, without installing it yet
+static int checksum_alloc(FILE *file, struct cs1550_checksums *table) {
+
+	table->blocks = image_blocks(file);
+	table->table_count = (table->blocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK;
+
+	table->crcs = calloc(table->table_count, BLOCK_SIZE);
+	table->tables = calloc(table->table_count, sizeof(long));
+	table->dirty = calloc(table->table_count, 1);
+
+	if (table->blocks <= 5 || table->crcs == NULL || table->tables == NULL || table->dirty == NULL) {
+
+		free(table->crcs);
+		free(table->tables);
+		free(table->dirty);
+
+		return -1;
+	}
+
+	return 1;
+}
+
+static void checksum_install(struct cs1550_checksums *table) {
+
+	pthread_mutex_lock(&checksums.lock);
+
+	checksums.blocks = table->blocks;
+	checksums.table_count = table->table_count;
+	checksums.tables = table->tables;
+	checksums.dirty = table->dirty;
+	__atomic_store_n(&checksums.crcs, table->crcs, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&checksums.lock);
+}
+
+//Reads the checksum table in, if the disk has one
+static int checksum_load(FILE *file) {
+
+	struct cs1550_superblock super;
+	struct cs1550_checksums table;
+	struct cs1550_io *ios;
+	cs1550_disk_block block;
+	struct cs1550_io io = { 0, &block, 1, 0 };
+	long location, found = 0;
+	long index;
+	int res;
+
+	if (checksums.crcs || read_superblock(file, &super, 0) == 0 || super.nChecksums == 0) {
+		return 1;
+	}
+
+	if (checksum_alloc(file, &table) != 1) {
+		return -1;
+	}
+
+	for (location = super.nChecksums; location && found < table.table_count; location = block.nNextBlock) {
+
+		io.location = location;
+
+		if (submit_batch(file, &io, 1) != 1) {
+			break;
+		}
+
+		for (index = 0; index < (long) CHECKSUM_TABLES_PER_BLOCK && found < table.table_count; index++) {
+			table.tables[found++] = ((long *) block.data)[index];
+		}
+	}
+
+	res = found == table.table_count ? 1 : -1;
+	ios = calloc(table.table_count, sizeof(struct cs1550_io));
+
+	for (index = 0; res == 1 && ios && index < table.table_count; index++) {
+
+		ios[index].location = table.tables[index];
+		ios[index].buffer = (char *) table.crcs + index * BLOCK_SIZE;
+		ios[index].count = 1;
+		ios[index].write = 0;
+	}
+
+	if (ios == NULL || (res == 1 && submit_batch(file, ios, table.table_count) != 1)) {
+		res = -1;
+	}
+
+	free(ios);
+
+	if (res != 1) {
+
+		free(table.crcs);
+		free(table.tables);
+		free(table.dirty);
+
+		return -1;
+	}
+
+	checksum_install(&table);
+
+	return 1;
+}
+
+//Writes every table block that changed since the last sync
+static int checksum_sync(FILE *file) {
+
+	struct cs1550_io *ios;
+	long index;
+	int count = 0;
+	int res = 1;
+
+	pthread_mutex_lock(&checksums.lock);
+
+	if (!checksums.any_dirty) {
+
+		pthread_mutex_unlock(&checksums.lock);
+		return 1;
+	}
+
+	ios = calloc(checksums.table_count, sizeof(struct cs1550_io));
+
+	for (index = 0; ios && index < checksums.table_count; index++) {
+
+		if (checksums.dirty[index]) {
+
+			ios[count].location = checksums.tables[index];
+			ios[count].buffer = (char *) checksums.crcs + index * BLOCK_SIZE;
+			ios[count].count = 1;
+			ios[count].write = 1;
+			count++;
+
+			checksums.dirty[index] = 0;
+		}
+	}
+
+	if (ios == NULL || submit_batch(file, ios, count) != 1) {
+		res = -1;
+	}
+
+	checksums.any_dirty = res != 1;
+
+	pthread_mutex_unlock(&checksums.lock);
+
+	free(ios);
+
+	return res;
+}
+
+//Whether the summary says nothing in these blocks is in use. Their checksums
+//are left at 0, which is never checked, until they are first written.
+static int checksum_unused(FILE *file, long block, int count) {
+
+	int unused;
+
+	pthread_mutex_lock(&bitmap_lock);
+
+	unused = layout_load(file) == 1 && block >= 8 && block + count <= layout.end && block / BITMAP_SPAN == (block + count - 1) / BITMAP_SPAN && layout.state[block / BITMAP_SPAN] == BITMAP_EMPTY;
+
+	pthread_mutex_unlock(&bitmap_lock);
+
+	return unused;
+}
+
+//Gives a disk that has never been checksummed its table: the table and index
+//blocks are allocated, then every other block in use is read once and
+//checksummed
+static int checksum_create(FILE *file) {
+
+	struct cs1550_superblock super;
+	struct cs1550_checksums table;
+	struct cs1550_io ios[RING_DEPTH];
+	cs1550_disk_block *index_blocks;
+	char *chunk;
+	long super_location = read_superblock(file, &super, 1);
+	long index_count, index, block;
+	int taken = 0, res = 1;
+
+	if (image_blocks(file) > CHECKSUM_MAX_BLOCKS) {
+
+		fprintf(stderr, "cs1550: a disk over %ld blocks is too big to checksum\n", CHECKSUM_MAX_BLOCKS);
+		return -1;
+	}
+
+	if (super_location == 0 || checksum_alloc(file, &table) != 1) {
+		return -1;
+	}
+
+	index_count = (table.table_count + CHECKSUM_TABLES_PER_BLOCK - 1) / CHECKSUM_TABLES_PER_BLOCK;
+	index_blocks = calloc(index_count, sizeof(cs1550_disk_block));
+	chunk = malloc(RING_DEPTH * BLOCK_SIZE);
+
+	if (index_blocks == NULL || chunk == NULL) {
+		res = -1;
+	}
+
+	//the table blocks are taken as few runs at a time as there is room for
+	for (index = 0; res == 1 && index < table.table_count; index += taken) {
+
+		if ((taken = retrieve_blocks(file, table.tables + index, table.table_count - index)) <= 0) {
+			res = -1;
+		}
+	}
+
+	//the table's own blocks are marked so they are not read, their checksums
+	//are cleared once everything else is done
+	for (index = 0; res == 1 && index < table.table_count; index++) {
+
+		((long *) index_blocks[index / CHECKSUM_TABLES_PER_BLOCK].data)[index % CHECKSUM_TABLES_PER_BLOCK] = table.tables[index];
+		table.crcs[table.tables[index]] = 1;
+	}
+
+	//the index blocks are chained through nNextBlock, first to last
+	for (index = index_count - 1; res == 1 && index >= 0; index--) {
+
+		long location = retrieve_block(file);
+
+		if (location < 0) {
+			res = -1;
+		}
+
+		else {
+
+			index_blocks[index].nNextBlock = index + 1 < index_count ? super.nChecksums : 0;
+			super.nChecksums = location;
+			table.crcs[location] = 1;
+		}
+	}
+
+	//everything from here on is written, so checksum it all as it stands
+	for (block = 0; res == 1 && block < table.blocks; block += RING_DEPTH) {
+
+		int count = table.blocks - block < RING_DEPTH ? table.blocks - block : RING_DEPTH;
+		int slot, reads = 0;
+
+		if (checksum_unused(file, block, count)) {
+			continue;
+		}
+
+		for (slot = 0; slot < count; slot++) {
+
+			if (table.crcs[block + slot] == 0) {
+
+				ios[reads].location = block + slot;
+				ios[reads].buffer = chunk + reads * BLOCK_SIZE;
+				ios[reads].count = 1;
+				ios[reads].write = 0;
+				reads++;
+			}
+		}
+
+		if (submit_batch(file, ios, reads) != 1) {
+			res = -1;
+		}
+
+		for (slot = 0; res == 1 && slot < reads; slot++) {
+			table.crcs[ios[slot].location] = block_crc(chunk + slot * BLOCK_SIZE);
+		}
+	}
+
+	for (index = 0; res == 1 && index < table.table_count; index++) {
+		table.crcs[table.tables[index]] = 0;
+	}
+
+	for (index = 0, block = super.nChecksums; res == 1 && index < index_count; block = index_blocks[index++].nNextBlock) {
+
+		struct cs1550_io io = { block, &index_blocks[index], 1, 1 };
+
+		table.crcs[block] = 0;
+		res = submit_batch(file, &io, 1);
+	}
+
+	free(index_blocks);
+	free(chunk);
+
+	if (res != 1) {
+
+		free(table.crcs);
+		free(table.tables);
+		free(table.dirty);
+
+		return -1;
+	}
+
+	memset(table.dirty, 1, table.table_count);
+
+	checksum_install(&table);
+	checksums.any_dirty = 1;
+
+	if (checksum_sync(file) != 1) {
+		return -1;
+	}
+
+	//the superblock is written last, so a disk never points at a
+	//half-built table
+	return write_block(file, super_location, &super) == 1 && checksum_sync(file) == 1 ? 1 : -1;
+}
+
+//Everything a mutating callback has to get onto the disk before it returns
+static int sync_metadata(FILE *file) {
+
+	int res = refcount_sync(file);
+
+	if (xattr_sync(file) != 1) {
+		res = -1;
+	}
+
+	if (checksum_sync(file) != 1) {
+		res = -1;
+	}
+
+	return res;
+}
+
+//Drops one extra owner if the block is shared. Returns 1 if it was, in which
+//case the block must stay allocated.
+static int refcount_drop(FILE *file, long location) {
+
+	long count = 0;
+
+	pthread_mutex_lock(&refcount_lock);
+
+	load_refcounts(file);
+
+	if (map_get(&refcounts, location, &count)) {
+
+		if (count > 1) {
+			map_put(&refcounts, location, count - 1);
+		}
+
+		else {
+			map_remove(&refcounts, location);
+		}
+
+		refcounts_dirty = 1;
+	}
+
+	pthread_mutex_unlock(&refcount_lock);
+
+	return count > 0;
+}
+
+static void refcount_totals(long *blocks, long *refs) {
+
+	size_t slot;
+
+	*blocks = 0;
+	*refs = 0;
+
+	pthread_mutex_lock(&refcount_lock);
+
+	for (slot = 0; slot < refcounts.capacity; slot++) {
+
+		if (refcounts.keys[slot]) {
+			*blocks += 1;
+			*refs += refcounts.values[slot];
+		}
+	}
+
+	pthread_mutex_unlock(&refcount_lock);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//A 64 bit hash of a whole data block. It only picks candidates, a match is
+//always confirmed byte for byte before a block is shared.
+static long fingerprint(const char *data) {
+
+	uint64_t hash = 0x9e3779b97f4a7c15ULL;
+	uint64_t word;
+	size_t index;
+
+	for (index = 0; index + sizeof(word) <= MAX_DATA_IN_BLOCK; index += sizeof(word)) {
+
+		memcpy(&word, data + index, sizeof(word));
+
+		hash ^= word * 0xc2b2ae3d27d4eb4fULL;
+		hash = ((hash << 31) | (hash >> 33)) * 0x9e3779b97f4a7c15ULL;
+	}
+
+	hash ^= hash >> 29;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 32;
+
+	//0 marks an empty slot in the index
+	return hash ? (long) hash : 1;
+}
+
+static void dedup_forget(long location) {
+
+	long hash, holder;
+
+	pthread_mutex_lock(&dedup_lock);
+
+	if (map_get(&block_fingerprints, location, &hash)) {
+
+		map_remove(&block_fingerprints, location);
+
+		if (map_get(&fingerprints, hash, &holder) && holder == location) {
+			map_remove(&fingerprints, hash);
+		}
+	}
+
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+static void dedup_remember(long location, long hash) {
+
+	dedup_forget(location);
+
+	pthread_mutex_lock(&dedup_lock);
+
+	map_put(&fingerprints, hash, location);
+	map_put(&block_fingerprints, location, hash);
+
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+//Returns a block already holding exactly this data, or 0
+static long dedup_find(FILE *file, const char *data, long hash) {
+
+	cs1550_disk_block block;
+	long location = 0;
+
+	pthread_mutex_lock(&dedup_lock);
+
+	map_get(&fingerprints, hash, &location);
+
+	pthread_mutex_unlock(&dedup_lock);
+
+	if (location && read_block(file, location, &block) == 1 && memcmp(block.data, data, MAX_DATA_IN_BLOCK) == 0) {
+		return location;
+	}
+
+	return 0;
+}
+
+//Adds the plain data blocks of every file under dir to the dedup index
+static void dedup_scan_directory(FILE *file, struct cs1550_dentry *dir) {
+
+	struct cs1550_cursor cursor;
+	struct cs1550_dentry entry;
+	char name[MAX_NAME + 1];
+	cs1550_node node;
+	cs1550_disk_block block;
+	int index;
+
+	if (dir_open(file, dir, &cursor) != 1) {
+		return;
+	}
+
+	while (dir_next(file, &cursor, &entry, name) == 1) {
+
+		if (entry.type == DT_DIR) {
+
+			dedup_scan_directory(file, &entry);
+			continue;
+		}
+
+		if (read_block(file, entry.nStartBlock, &node) != 1 || (node.value & (NODE_INLINE | NODE_COMPRESSED))) {
+			continue;
+		}
+
+		for (index = 0; index < node.next_node; index++) {
+
+			if (node.node_pointers[index] && read_block(file, node.node_pointers[index], &block) == 1) {
+				dedup_remember(node.node_pointers[index], fingerprint(block.data));
+			}
+		}
+	}
+}
+
+//Fills the dedup index with every plain data block already on disk
+static void dedup_scan(FILE *file) {
+
+	struct cs1550_dentry root;
+
+	root_entry(&root, 0);
+	dedup_scan_directory(file, &root);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//Drops one owner of a data block, freeing it once nobody is left
+static int release_block(FILE *file, long location) {
+
+	if (refcount_drop(file, location)) {
+		return 1;
+	}
+
+	dedup_forget(location);
+
+	return free_block(file, location);
+}
+
+static int find_file(FILE *file, const char *path, struct cs1550_file *found) {
+
+	int res = walk(file, path, &found->entry);
+
+	if (res != 1) {
+		return res;
+	}
+
+	if (found->entry.type == DT_DIR) {
+		return -EISDIR;
+	}
+
+	found->location = found->entry.nStartBlock;
+	found->size = found->entry.fsize;
+
+	return read_block(file, found->location, &found->node) == 1 ? 1 : -EIO;
+}
+
+static int set_file_size(FILE *file, struct cs1550_file *found, size_t size) {
+
+	found->size = size;
+
+	return entry_set_size(file, &found->entry, size);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static int release_extent(FILE *file, long extent) {
+
+	struct cs1550_group *cached = &group_cache[extent % GROUP_CACHE_SIZE];
+	cs1550_disk_block block;
+	long location = extent;
+
+	//a shared extent is owned through its first block
+	if (refcount_drop(file, extent)) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&group_cache_lock);
+
+	if (cached->extent == extent) {
+		cached->extent = 0;
+	}
+
+	pthread_mutex_unlock(&group_cache_lock);
+
+	while (location) {
+
+		if (read_block(file, location, &block) != 1 || free_block(file, location) != 1) {
+			return -1;
+		}
+
+		location = block.nNextBlock;
+	}
+
+	return 1;
+}
+
+//Blocks taken ahead of a write-back, so its data lands in one run and the
+//bitmap is read and written once rather than once per block. They are handed
+//out in order to whatever data this thread stores next.
+static __thread struct cs1550_reservation {
+	long blocks[NODE_POINTERS];
+	int count;
+	int next;
+} reservation;
+
+static long allocate_block(FILE *file) {
+
+	if (reservation.next < reservation.count) {
+		return reservation.blocks[reservation.next++];
+	}
+
+	return retrieve_block(file);
+}
+
+//Compresses length bytes of data into a new extent and returns its first
+//block
+static long store_extent(FILE *file, const char *data, int length) {
+
+	char stream[COMPRESS_GROUP_BLOCKS * MAX_DATA_IN_BLOCK];
+	long locations[COMPRESS_GROUP_BLOCKS];
+	cs1550_disk_block chain[COMPRESS_GROUP_BLOCKS];
+	struct cs1550_io ios[COMPRESS_GROUP_BLOCKS];
+	struct cs1550_extent_header header;
+	int blocks, index;
+
+	header.length = length;
+	header.stored = lz_compress((const unsigned char *) data, length, (unsigned char *) stream + sizeof(header), length - 1);
+
+	if (header.stored < 0) {
+
+		header.stored = length;
+		memcpy(stream + sizeof(header), data, length);
+	}
+
+	memcpy(stream, &header, sizeof(header));
+
+	stats_compressed(length, header.stored);
+
+	blocks = (sizeof(header) + header.stored + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+
+	for (index = 0; index < blocks; index++) {
+
+		locations[index] = allocate_block(file);
+
+		if (locations[index] < 0) {
+
+			while (index-- > 0) {
+				free_block(file, locations[index]);
+			}
+
+			return -ENOSPC;
+		}
+	}
+
+	//the whole extent goes out as one batch
+	for (index = 0; index < blocks; index++) {
+
+		chain[index].nNextBlock = index + 1 < blocks ? locations[index + 1] : 0;
+		memcpy(chain[index].data, stream + index * MAX_DATA_IN_BLOCK, MAX_DATA_IN_BLOCK);
+
+		ios[index].location = locations[index];
+		ios[index].buffer = &chain[index];
+		ios[index].count = 1;
+		ios[index].write = 1;
+	}
+
+	//nothing points at the extent yet, so its blocks go straight back
+	if (run_batch(file, ios, blocks) != 1) {
+
+		free_blocks(file, locations, blocks);
+		return -EIO;
+	}
+
+	return locations[0];
+}
+
+//Decompresses the extent starting at the given block into data
+static int load_extent(FILE *file, long extent, char *data) {
+
+	char stream[COMPRESS_GROUP_BLOCKS * MAX_DATA_IN_BLOCK];
+	struct cs1550_group *cached = &group_cache[extent % GROUP_CACHE_SIZE];
+	struct cs1550_extent_header header;
+	cs1550_disk_block block;
+	long location = extent;
+	int used = 0;
+	int length;
+
+	pthread_mutex_lock(&group_cache_lock);
+
+	if (cached->extent == extent) {
+
+		length = cached->length;
+		memcpy(data, cached->data, length);
+
+		pthread_mutex_unlock(&group_cache_lock);
+		stats_cache(1);
+
+		return length;
+	}
+
+	pthread_mutex_unlock(&group_cache_lock);
+	stats_cache(0);
+
+	do {
+		if (used == sizeof(stream) || read_block(file, location, &block) != 1) {
+			return -EIO;
+		}
+
+		memcpy(stream + used, block.data, MAX_DATA_IN_BLOCK);
+		used += MAX_DATA_IN_BLOCK;
+		location = block.nNextBlock;
+
+		memcpy(&header, stream, sizeof(header));
+	} while (used < (int) sizeof(header) + header.stored);
+
+	if (header.stored < 0 || header.length < 0 || header.length > (int) GROUP_SIZE || header.stored > header.length) {
+		return -EIO;
+	}
+
+	if (header.stored == header.length) {
+		memcpy(data, stream + sizeof(header), header.length);
+	}
+
+	else if (lz_decompress((unsigned char *) stream + sizeof(header), header.stored, (unsigned char *) data, header.length) != header.length) {
+		return -EIO;
+	}
+
+	pthread_mutex_lock(&group_cache_lock);
+
+	cached->extent = extent;
+	cached->length = header.length;
+	memcpy(cached->data, data, header.length);
+
+	pthread_mutex_unlock(&group_cache_lock);
+
+	return header.length;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//A file's data is addressed in units: one disk block's worth for plain files,
+//one group for compressed ones. node_pointers[n] is where unit n lives, and a
+//0 there is a hole that reads back as zeros. An inline file is a single unit
+//held in the node.
+static size_t data_unit(cs1550_node *node) {
+
+	if (node->value & NODE_INLINE) {
+		return INLINE_MAX;
+	}
+
+	return node->value & NODE_COMPRESSED ? GROUP_SIZE : MAX_DATA_IN_BLOCK;
+}
+
+//Whether a unit has data behind it rather than being a hole
+static int unit_present(cs1550_node *node, long index) {
+
+	if (node->value & NODE_INLINE) {
+		return 1;
+	}
+
+	return index < node->next_node && node->node_pointers[index] != 0;
+}
+
+//Fills data with the unit's contents, zero past whatever it holds
+static int load_unit(FILE *file, struct cs1550_file *found, long index, char *data) {
+
+	size_t unit = data_unit(&found->node);
+	cs1550_disk_block block;
+	int length;
+
+	memset(data, 0, unit);
+
+	if (found->node.value & NODE_INLINE) {
+
+		memcpy(data, found->node.node_pointers, unit);
+		return 1;
+	}
+
+	//holes cost no I/O at all
+	if (!unit_present(&found->node, index)) {
+		return 1;
+	}
+
+	if (found->node.value & NODE_COMPRESSED) {
+
+		length = load_extent(file, found->node.node_pointers[index], data);
+
+		return length < 0 ? length : 1;
+	}
+
+	if (read_block(file, found->node.node_pointers[index], &block) != 1) {
+		return -EIO;
+	}
+
+	memcpy(data, block.data, unit);
+
+	return 1;
+}
+
+//Puts a plain unit's data on disk and returns the block now holding it. With
+//dedup on, identical data already on disk is shared instead of written again.
+//A shared block is never written in place: the writer gets a copy of its own.
+static long store_block(FILE *file, struct cs1550_file *found, long index, const char *data) {
+
+	cs1550_disk_block block;
+	long previous = index < found->node.next_node ? found->node.node_pointers[index] : 0;
+	long location = 0;
+	long hash = 0;
+
+	if (options.dedup) {
+
+		hash = fingerprint(data);
+		location = dedup_find(file, data, hash);
+
+		if (location == previous && location) {
+			return location;
+		}
+
+		if (location) {
+
+			refcount_add(file, location, 1);
+			stats_dedup(1);
+
+			if (previous) {
+				release_block(file, previous);
+			}
+
+			return location;
+		}
+	}
+
+	if (previous && refcount_get(file, previous) == 0) {
+
+		location = previous;
+		dedup_forget(location);
+	}
+
+	else if ((location = allocate_block(file)) < 0) {
+		return -ENOSPC;
+	}
+
+	else if (previous) {
+		release_block(file, previous);
+	}
+
+	block.nNextBlock = 0;
+	memcpy(block.data, data, MAX_DATA_IN_BLOCK);
+
+	if (write_block(file, location, &block) != 1) {
+		return -EIO;
+	}
+
+	if (options.dedup) {
+
+		dedup_remember(location, hash);
+		stats_dedup(0);
+	}
+
+	return location;
+}
+
+//Writes length bytes of the unit back, updating found->node in memory only
+static int store_unit(FILE *file, struct cs1550_file *found, long index, const char *data, size_t length) {
+
+	long location;
+
+	if (found->node.value & NODE_INLINE) {
+
+		memcpy(found->node.node_pointers, data, INLINE_MAX);
+		return 1;
+	}
+
+	if (found->node.value & NODE_COMPRESSED) {
+
+		location = store_extent(file, data, length);
+
+		if (location < 0) {
+			return location;
+		}
+
+		if (index < found->node.next_node && found->node.node_pointers[index]) {
+			release_extent(file, found->node.node_pointers[index]);
+		}
+	}
+
+	else if ((location = store_block(file, found, index, data)) < 0) {
+		return location;
+	}
+
+	//anything skipped over on the way out here is a hole
+	while (found->node.next_node <= index) {
+		found->node.node_pointers[found->node.next_node++] = 0;
+	}
+
+	found->node.node_pointers[index] = location;
+
+	return 1;
+}
+
+//Turns a whole unit back into a hole
+static void punch_unit(FILE *file, struct cs1550_file *found, long index) {
+
+	long location;
+
+	if (index >= found->node.next_node || (location = found->node.node_pointers[index]) == 0) {
+		return;
+	}
+
+	if (found->node.value & NODE_COMPRESSED) {
+		release_extent(file, location);
+	}
+
+	else {
+		release_block(file, location);
+	}
+
+	found->node.node_pointers[index] = 0;
+}
+
+static void release_units(FILE *file, struct cs1550_file *found) {
+
+	int index;
+
+	for (index = 0; index < found->node.next_node; index++) {
+		punch_unit(file, found, index);
+	}
+
+	found->node.next_node = 0;
+}
+
+static int spill_inline(FILE *file, struct cs1550_file *found);
+
+//A plain file's blocks are all known from the node, so every one the read
+//touches is fetched in a single batch rather than one after another
+static int read_plain(FILE *file, struct cs1550_file *found, char *buf, size_t size, off_t offset) {
+
+	long first = offset / MAX_DATA_IN_BLOCK;
+	long last = (offset + size - 1) / MAX_DATA_IN_BLOCK;
+	cs1550_disk_block *blocks[NODE_POINTERS];
+	struct cs1550_io ios[NODE_POINTERS];
+	size_t done = 0;
+	long index;
+	int queued = 0;
+	int res = 1;
+
+	//holes stay zero and are never asked for
+	for (index = first; index <= last; index++) {
+
+		blocks[index - first] = NULL;
+
+		if (res == 1 && unit_present(&found->node, index)) {
+
+			if ((blocks[index - first] = pool_get(POOL_BLOCK)) == NULL) {
+				res = -ENOMEM;
+			}
+
+			ios[queued].location = found->node.node_pointers[index];
+			ios[queued].buffer = blocks[index - first];
+			ios[queued].count = 1;
+			ios[queued].write = 0;
+			queued++;
+		}
+	}
+
+	if (res == 1 && queued && run_batch(file, ios, queued) != 1) {
+		res = -EIO;
+	}
+
+	for (index = first; index <= last; index++) {
+
+		size_t start = index == first ? offset % MAX_DATA_IN_BLOCK : 0;
+		size_t count = MAX_DATA_IN_BLOCK - start;
+
+		if (count > size - done) {
+			count = size - done;
+		}
+
+		if (res == 1) {
+
+			if (blocks[index - first]) {
+				memcpy(buf + done, blocks[index - first]->data + start, count);
+			}
+
+			else {
+				memset(buf + done, 0, count);
+			}
+		}
+
+		pool_put(POOL_BLOCK, blocks[index - first]);
+		done += count;
+	}
+
+	return res == 1 ? (int) done : res;
+}
+
+static int read_data(FILE *file, struct cs1550_file *found, char *buf, size_t size, off_t offset) {
+
+	char data[GROUP_SIZE];
+	size_t unit = data_unit(&found->node);
+	size_t done = 0;
+	int res;
+
+	if (offset >= (off_t) found->size) {
+		return 0;
+	}
+
+	if (offset + size > found->size) {
+		size = found->size - offset;
+	}
+
+	if (!(found->node.value & (NODE_INLINE | NODE_COMPRESSED))) {
+		return read_plain(file, found, buf, size, offset);
+	}
+
+	while (done < size) {
+
+		long index = (offset + done) / unit;
+		size_t start = (offset + done) % unit;
+		size_t count = unit - start;
+
+		if (count > size - done) {
+			count = size - done;
+		}
+
+		if ((res = load_unit(file, found, index, data)) < 0) {
+			return res;
+		}
+
+		memcpy(buf + done, data + start, count);
+		done += count;
+	}
+
+	return done;
+}
+
+static int write_data(FILE *file, struct cs1550_file *found, const char *buf, size_t size, off_t offset) {
+
+	char data[GROUP_SIZE];
+	size_t unit;
+	size_t end = offset + size;
+	size_t done = 0;
+	int res = 0;
+
+	if ((found->node.value & NODE_INLINE) && end > INLINE_MAX && (res = spill_inline(file, found)) < 0) {
+		return res;
+	}
+
+	unit = data_unit(&found->node);
+
+	if (end > unit * NODE_POINTERS) {
+		return -EFBIG;
+	}
+
+	while (done < size) {
+
+		long index = (offset + done) / unit;
+		size_t start = (offset + done) % unit;
+		size_t count = unit - start;
+		size_t length;
+
+		if (count > size - done) {
+			count = size - done;
+		}
+
+		//only a partial unit needs what was there before
+		if (start || count < unit) {
+			res = load_unit(file, found, index, data);
+		}
+
+		if (res < 0) {
+			break;
+		}
+
+		memcpy(data + start, buf + done, count);
+
+		length = (end > found->size ? end : found->size) - index * unit;
+
+		if ((res = store_unit(file, found, index, data, length < unit ? length : unit)) < 0) {
+			break;
+		}
+
+		done += count;
+	}
+
+	if (write_block(file, found->location, &found->node) != 1) {
+		return -EIO;
+	}
+
+	if (offset + done > found->size && set_file_size(file, found, offset + done) != 1) {
+		return -EIO;
+	}
+
+	return done ? (int) done : res;
+}
+
+//Moves an inline file's data out into data blocks once it outgrows the node
+static int spill_inline(FILE *file, struct cs1550_file *found) {
+
+	char data[INLINE_MAX];
+	size_t size = found->size;
+	int res;
+
+	memcpy(data, found->node.node_pointers, INLINE_MAX);
+	memset(found->node.node_pointers, 0, INLINE_MAX);
+
+	found->node.value &= ~NODE_INLINE;
+	found->node.next_node = 0;
+	found->size = 0;
+
+	res = write_data(file, found, data, size, 0);
+
+	return res < 0 ? res : 1;
+}
+
+//Rewrites the file's data with compression switched on or off
+static int set_compression(FILE *file, struct cs1550_file *found, int compress) {
+
+	size_t size = found->size;
+	char *data;
+	int res;
+
+	if (!(found->node.value & NODE_COMPRESSED) == !compress) {
+		return 0;
+	}
+
+	//inline data is never compressed, only its later spill is
+	if (found->node.value & NODE_INLINE) {
+
+		found->node.value ^= NODE_COMPRESSED;
+		return write_block(file, found->location, &found->node) == 1 ? 0 : -EIO;
+	}
+
+	if (!compress && size > MAX_DATA_IN_BLOCK * NODE_POINTERS) {
+		return -EFBIG;
+	}
+
+	if ((data = malloc(size + 1)) == NULL) {
+		return -ENOMEM;
+	}
+
+	if ((res = read_data(file, found, data, size, 0)) < 0) {
+		free(data);
+		return res;
+	}
+
+	release_units(file, found);
+
+	found->node.value ^= NODE_COMPRESSED;
+	found->size = 0;
+
+	res = write_data(file, found, data, size, 0);
+	free(data);
+
+	if (res == 0 && write_block(file, found->location, &found->node) != 1) {
+		res = -EIO;
+	}
+
+	return res < 0 ? res : 0;
+}
+
+//Zeroes part of the file, giving back every unit the range covers entirely
+static int punch_hole(FILE *file, struct cs1550_file *found, off_t offset, off_t length) {
+
+	char zeros[GROUP_SIZE];
+	size_t unit = data_unit(&found->node);
+	off_t end = offset + length;
+	off_t first, last;
+	long index;
+	int res;
+
+	if (end > (off_t) found->size) {
+		end = found->size;
+	}
+
+	if (offset >= end) {
+		return 0;
+	}
+
+	memset(zeros, 0, sizeof(zeros));
+
+	//whole units in the middle become holes
+	first = (offset + unit - 1) / unit;
+	last = end / unit;
+
+	if (found->node.value & NODE_INLINE) {
+		first = last = 0;
+	}
+
+	for (index = first; index < last; index++) {
+		punch_unit(file, found, index);
+	}
+
+	//and the partial units at either end are zeroed in place, unless
+	//they are already holes
+	if (first >= last) {
+
+		if (unit_present(&found->node, offset / unit) && (res = write_data(file, found, zeros, end - offset, offset)) < 0) {
+			return res;
+		}
+	}
+
+	else {
+
+		if (offset < first * (off_t) unit && unit_present(&found->node, first - 1) && (res = write_data(file, found, zeros, first * unit - offset, offset)) < 0) {
+			return res;
+		}
+
+		if (end > last * (off_t) unit && unit_present(&found->node, last) && (res = write_data(file, found, zeros, end - last * unit, last * unit)) < 0) {
+			return res;
+		}
+	}
+
+	return write_block(file, found->location, &found->node) == 1 ? 0 : -EIO;
+}
+
+//Makes sure every unit in the range has a block behind it
+static int preallocate(FILE *file, struct cs1550_file *found, off_t offset, off_t length, int keep_size) {
+
+	char zeros[GROUP_SIZE];
+	size_t unit;
+	off_t end = offset + length;
+	long index;
+	int res;
+
+	if ((found->node.value & NODE_INLINE) && end > (off_t) INLINE_MAX && (res = spill_inline(file, found)) < 0) {
+		return res;
+	}
+
+	unit = data_unit(&found->node);
+
+	if (end > (off_t) (unit * NODE_POINTERS)) {
+		return -EFBIG;
+	}
+
+	memset(zeros, 0, sizeof(zeros));
+
+	//compressed groups are sized by what they hold, so only plain files
+	//can have space set aside ahead of time
+	if (!(found->node.value & (NODE_INLINE | NODE_COMPRESSED))) {
+
+		for (index = offset / unit; index * (off_t) unit < end; index++) {
+
+			if (!unit_present(&found->node, index) && (res = store_unit(file, found, index, zeros, unit)) < 0) {
+				return res;
+			}
+		}
+
+		if (write_block(file, found->location, &found->node) != 1) {
+			return -EIO;
+		}
+	}
+
+	if (!keep_size && end > (off_t) found->size && set_file_size(file, found, end) != 1) {
+		return -EIO;
+	}
+
+	return 0;
+}
+
+//Sets the file's size. Every unit wholly past the new end is given back,
+//and the rest of the last one is zeroed so growing the file again later
+//reads zeros there. Growing only sets the size and leaves a hole.
+static int truncate_data(FILE *file, struct cs1550_file *found, size_t size) {
+
+	char zeros[GROUP_SIZE];
+	size_t unit, end;
+	long index, keep;
+	int res;
+
+	if ((found->node.value & NODE_INLINE) && size > INLINE_MAX && (res = spill_inline(file, found)) < 0) {
+		return res;
+	}
+
+	unit = data_unit(&found->node);
+
+	if (size > unit * NODE_POINTERS) {
+		return -EFBIG;
+	}
+
+	if (size >= found->size) {
+		return set_file_size(file, found, size) == 1 ? 0 : -EIO;
+	}
+
+	if (found->node.value & NODE_INLINE) {
+		memset((char *) found->node.node_pointers + size, 0, INLINE_MAX - size);
+	}
+
+	else {
+
+		keep = (size + unit - 1) / unit;
+
+		for (index = keep; index < found->node.next_node; index++) {
+			punch_unit(file, found, index);
+		}
+
+		if (found->node.next_node > keep) {
+			found->node.next_node = keep;
+		}
+
+		end = keep * unit < found->size ? keep * unit : found->size;
+		memset(zeros, 0, sizeof(zeros));
+
+		if (size % unit && unit_present(&found->node, size / unit) && (res = write_data(file, found, zeros, end - size, size)) < 0) {
+			return res;
+		}
+	}
+
+	if (write_block(file, found->location, &found->node) != 1) {
+		return -EIO;
+	}
+
+	return set_file_size(file, found, size) == 1 ? 0 : -EIO;
+}
+
+//FUSE 2 never passes lseek down to us, so SEEK_DATA and SEEK_HOLE are
+//answered through an ioctl instead: offset goes in, the answer comes out
+struct cs1550_seek {
+	off_t offset;
+	int whence;
+};
+
+#define CS1550_IOC_SEEK _IOWR('c', 1, struct cs1550_seek)
+
+//Where the next data or hole is at or after offset, as lseek would say
+static off_t seek_data(struct cs1550_file *found, off_t offset, int whence) {
+
+	size_t unit = data_unit(&found->node);
+	long index;
+
+	if (offset < 0 || offset >= (off_t) found->size) {
+		return -ENXIO;
+	}
+
+	for (index = offset / unit; index * (off_t) unit < (off_t) found->size; index++) {
+
+		if (unit_present(&found->node, index) == (whence == SEEK_DATA)) {
+			return index * (off_t) unit > offset ? index * (off_t) unit : offset;
+		}
+	}
+
+	//there is always a hole at the end of the file
+	return whence == SEEK_DATA ? -ENXIO : (off_t) found->size;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//Reads the snapshot table, making an empty one first when create is set.
+//Returns where the table is, 0 if there is none.
+static long read_snapshots(FILE *file, struct cs1550_snapshot_table *table, int create) {
+
+	struct cs1550_superblock super;
+	long location = read_superblock(file, &super, create);
+	long table_location;
+
+	if (location == 0) {
+		return 0;
+	}
+
+	if (super.nSnapshots) {
+		return read_block(file, super.nSnapshots, table) == 1 ? super.nSnapshots : 0;
+	}
+
+	if (!create || (table_location = retrieve_block(file)) < 0) {
+		return 0;
+	}
+
+	memset(table, 0, sizeof(struct cs1550_snapshot_table));
+	super.nSnapshots = table_location;
+
+	if (write_block(file, table_location, table) != 1 || write_block(file, location, &super) != 1) {
+		return 0;
+	}
+
+	return table_location;
+}
+
+//Where the named snapshot's root is, 0 if there is no such snapshot
+static long snapshot_lookup(FILE *file, const char *name) {
+
+	struct cs1550_snapshot_table table;
+	int index;
+
+	if (read_snapshots(file, &table, 0) == 0) {
+		return 0;
+	}
+
+	for (index = 0; index < table.nSnapshots; index++) {
+
+		if (strcmp(table.snapshots[index].name, name) == 0) {
+			return table.snapshots[index].nRoot;
+		}
+	}
+
+	return 0;
+}
+
+//Takes or gives back a reference on every unit a node points at
+static void share_units(FILE *file, cs1550_node *node, int take) {
+
+	int index;
+
+	if (node->value & NODE_INLINE) {
+		return;
+	}
+
+	for (index = 0; index < node->next_node; index++) {
+
+		long location = node->node_pointers[index];
+
+		if (location == 0) {
+			continue;
+		}
+
+		//a compressed extent is owned through its first block
+		if (take) {
+			refcount_add(file, location, 1);
+		}
+
+		else if (node->value & NODE_COMPRESSED) {
+			release_extent(file, location);
+		}
+
+		else {
+			release_block(file, location);
+		}
+	}
+}
+
+//Frees a directory's own blocks: its first block, the rest of its chain, and
+//the chain a fixed-slot directory was extended with
+static void free_directory_blocks(FILE *file, struct cs1550_dentry *dir) {
+
+	struct cs1550_cursor cursor;
+	long location;
+
+	if (dir_open(file, dir, &cursor) != 1) {
+		return;
+	}
+
+	location = dir->nStartBlock;
+
+	if (cursor.format != DIR_DIRENT) {
+
+		free_block(file, location);
+		location = dir_extension(file, &cursor, 0);
+	}
+
+	while (location > 0 && read_block(file, location, &cursor.block.dirent) == 1) {
+
+		long next = cursor.block.dirent.nNextBlock;
+
+		free_block(file, location);
+		location = next;
+	}
+}
+
+//Gives back one entry of a frozen tree and everything under it: metadata
+//blocks are freed, and data blocks lose one owner each, which frees the ones
+//nothing else holds
+static void release_entry(FILE *file, struct cs1550_dentry *entry) {
+
+	struct cs1550_cursor cursor;
+	struct cs1550_dentry child;
+	char name[MAX_NAME + 1];
+	cs1550_node node;
+
+	if (entry->type != DT_DIR) {
+
+		if (read_block(file, entry->nStartBlock, &node) == 1) {
+
+			share_units(file, &node, 0);
+			xattr_drop(file, entry->nStartBlock);
+			free_block(file, entry->nStartBlock);
+		}
+
+		return;
+	}
+
+	if (dir_open(file, entry, &cursor) == 1) {
+
+		while (dir_next(file, &cursor, &child, name) == 1) {
+			release_entry(file, &child);
+		}
+	}
+
+	xattr_drop(file, entry->nStartBlock);
+	free_directory_blocks(file, entry);
+}
+
+static void release_tree(FILE *file, long location) {
+
+	struct cs1550_dentry root;
+
+	root_entry(&root, location);
+	release_entry(file, &root);
+
+	//its directory blocks may be handed out again
+	dcache_flush();
+}
+
+//Copies an index node into a fresh block that shares its data
+static long copy_node(FILE *file, long location) {
+
+	cs1550_node node;
+	long copy;
+
+	if (read_block(file, location, &node) != 1) {
+		return -EIO;
+	}
+
+	if ((copy = retrieve_block(file)) < 0) {
+		return -ENOSPC;
+	}
+
+	if (write_block(file, copy, &node) != 1 || xattr_copy(file, location, copy) != 1) {
+
+		xattr_drop(file, copy);
+		free_block(file, copy);
+		return -EIO;
+	}
+
+	share_units(file, &node, 1);
+
+	return copy;
+}
+
+//Copies dir and everything under it into fresh dirent chains and index nodes.
+//Returns the copy's first block. On failure whatever was copied so far is
+//given back.
+static long copy_directory(FILE *file, struct cs1550_dentry *dir) {
+
+	struct cs1550_cursor cursor;
+	struct cs1550_builder builder;
+	struct cs1550_dentry entry, copy;
+	char name[MAX_NAME + 1];
+	long location;
+	int res;
+
+	memset(&builder, 0, sizeof(builder));
+
+	if (dir_open(file, dir, &cursor) != 1) {
+		return -EIO;
+	}
+
+	while ((res = dir_next(file, &cursor, &entry, name)) == 1) {
+
+		location = entry.type == DT_DIR ? copy_directory(file, &entry) : copy_node(file, entry.nStartBlock);
+
+		if (location < 0) {
+
+			res = location;
+			break;
+		}
+
+		if ((res = builder_add(file, &builder, name, entry.type, location, entry.fsize, NULL)) != 1) {
+
+			entry.nStartBlock = location;
+			release_entry(file, &entry);
+			break;
+		}
+	}
+
+	if (builder_finish(file, &builder) != 1) {
+		return -EIO;
+	}
+
+	if (res >= 0 && builder.first && xattr_copy(file, dir->nStartBlock, builder.first) != 1) {
+		res = -EIO;
+	}
+
+	if (res < 0) {
+
+		memset(&copy, 0, sizeof(copy));
+		copy.type = DT_DIR;
+		copy.nStartBlock = builder.first;
+
+		release_entry(file, &copy);
+
+		return res == -1 ? -EIO : res;
+	}
+
+	return builder.first;
+}
+
+//Copies the live tree into fresh blocks that share every data block with it.
+//The frozen root holds nothing but the chain the copy is in. Returns the
+//frozen root.
+static long freeze_tree(FILE *file) {
+
+	cs1550_root_directory frozen;
+	struct cs1550_dentry live;
+	long location, chain;
+
+	if (read_block(file, 0, &frozen) != 1 || (location = retrieve_block(file)) < 0) {
+		return -ENOSPC;
+	}
+
+	root_entry(&live, 0);
+
+	if ((chain = copy_directory(file, &live)) < 0) {
+
+		free_block(file, location);
+		return chain;
+	}
+
+	memset(frozen.directories, 0, sizeof(frozen.directories));
+	frozen.directories[0].nStartBlock = chain;
+	frozen.nDirectories = 1;
+
+	if (write_block(file, location, &frozen) != 1) {
+
+		live.root = 0;
+		live.nStartBlock = chain;
+
+		release_entry(file, &live);
+		free_block(file, location);
+
+		return -EIO;
+	}
+
+	return location;
+}
+
+static int delay_sync_all(FILE *file);
+
+static int snapshot_create(FILE *file, const char *name) {
+
+	struct cs1550_snapshot_table table;
+	long location, root;
+
+	if (name[0] == '\0') {
+		return -EINVAL;
+	}
+
+	if (strlen(name) > MAX_FILENAME) {
+		return -ENAMETOOLONG;
+	}
+
+	if (snapshot_lookup(file, name)) {
+		return -EEXIST;
+	}
+
+	if ((location = read_snapshots(file, &table, 1)) == 0) {
+		return -ENOSPC;
+	}
+
+	if (table.nSnapshots == (int) MAX_SNAPSHOTS) {
+		return -ENOSPC;
+	}
+
+	//writes still held back in memory belong in the snapshot too
+	if (delay_sync_all(file) < 0) {
+		return -EIO;
+	}
+
+	if ((root = freeze_tree(file)) < 0) {
+		return root;
+	}
+
+	strcpy(table.snapshots[table.nSnapshots].name, name);
+	table.snapshots[table.nSnapshots].nRoot = root;
+	table.snapshots[table.nSnapshots].created = time(NULL);
+	table.nSnapshots++;
+
+	return write_block(file, location, &table) == 1 ? 0 : -EIO;
+}
+
+static int snapshot_delete(FILE *file, const char *name) {
+
+	struct cs1550_snapshot_table table;
+	long location = read_snapshots(file, &table, 0);
+	int index;
+
+	for (index = 0; location && index < table.nSnapshots; index++) {
+
+		if (strcmp(table.snapshots[index].name, name) == 0) {
+
+			long root = table.snapshots[index].nRoot;
+
+			table.nSnapshots--;
+			memmove(&table.snapshots[index], &table.snapshots[index + 1], (table.nSnapshots - index) * sizeof(struct cs1550_snapshot));
+			memset(&table.snapshots[table.nSnapshots], 0, sizeof(struct cs1550_snapshot));
+
+			//the table forgets it first, so a crash leaks blocks at worst
+			if (write_block(file, location, &table) != 1) {
+				return -EIO;
+			}
+
+			release_tree(file, root);
+
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+//Lists the snapshots as "name created" lines into a freshly allocated
+//buffer the caller must free
+static char *snapshots_render(size_t *length) {
+
+	struct cs1550_snapshot_table table;
+	char *text = NULL;
+	FILE *out = open_memstream(&text, length);
+	FILE *file = fopen(".disk", "rb");
+	int index;
+
+	if (out == NULL) {
+
+		if (file) {
+			fclose(file);
+		}
+
+		return NULL;
+	}
+
+	if (file && read_snapshots(file, &table, 0)) {
+
+		for (index = 0; index < table.nSnapshots; index++) {
+			fprintf(out, "%s %ld\n", table.snapshots[index].name, table.snapshots[index].created);
+		}
+	}
+
+	if (file) {
+		fclose(file);
+	}
+
+	fclose(out);
+
+	return text;
+}
+
+static int snapshots_getattr(struct stat *stbuf) {
+
+	size_t length;
+	char *text = snapshots_render(&length);
+
+	if (text == NULL) {
+		return -ENOMEM;
+	}
+
+	free(text);
+
+	stbuf->st_mode = S_IFREG | (read_only ? 0444 : 0644);
+	stbuf->st_nlink = 1;
+	stbuf->st_size = length;
+
+	return 0;
+}
+
+static int snapshots_read(char *buf, size_t size, off_t offset) {
+
+	size_t length;
+	char *text = snapshots_render(&length);
+
+	if (text == NULL) {
+		return -ENOMEM;
+	}
+
+	if (offset >= (off_t) length) {
+		size = 0;
+	}
+
+	else if (offset + size > length) {
+		size = length - offset;
+	}
+
+	memcpy(buf, text + offset, size);
+	free(text);
+
+	return size;
+}
+
+//Each line written is a command: "create NAME" or "delete NAME"
+static int snapshots_write(const char *buf, size_t size) {
+
+	char command[BLOCK_SIZE];
+	char verb[16], name[16];
+	char *line, *next;
+	FILE *file;
+	int res = 0;
+
+	if (read_only) {
+		return -EROFS;
+	}
+
+	if (size >= sizeof(command)) {
+		return -EINVAL;
+	}
+
+	memcpy(command, buf, size);
+	command[size] = '\0';
+
+	file = fopen(".disk", "rb+");
+
+	if (file == NULL) {
+		return -EIO;
+	}
+
+	for (line = command; res == 0 && line && *line; line = next) {
+
+		if ((next = strchr(line, '\n'))) {
+			*next++ = '\0';
+		}
+
+		if (sscanf(line, "%15s %15s", verb, name) != 2) {
+			res = line[strspn(line, " \t")] ? -EINVAL : 0;
+		}
+
+		else if (strcmp(verb, "create") == 0) {
+			res = snapshot_create(file, name);
+		}
+
+		else if (strcmp(verb, "delete") == 0) {
+			res = snapshot_delete(file, name);
+		}
+
+		else {
+			res = -EINVAL;
+		}
+	}
+
+	if (sync_metadata(file) != 1 && res == 0) {
+		res = -EIO;
+	}
+
+	fclose(file);
+
+	return res < 0 ? res : (int) size;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//FUSE 2 has no copy_file_range, and FICLONE names its source by a descriptor
+//that means nothing in here, so cloning takes the source's path instead.
+//The ioctl is made on the destination.
+struct cs1550_clone {
+	char source[1024];	//file to share blocks with, from the root of the mount
+	off_t src_offset;
+	off_t length;		//0 clones the whole file, replacing what was there
+	off_t dest_offset;
+};
+
+#define CS1550_IOC_CLONE _IOW('c', 2, struct cs1550_clone)
+
+//Makes dest an exact copy of source that shares all of its data
+static int clone_file(FILE *file, struct cs1550_file *source, struct cs1550_file *dest) {
+
+	release_units(file, dest);
+
+	dest->node = source->node;
+	share_units(file, &dest->node, 1);
+
+	if (write_block(file, dest->location, &dest->node) != 1 || set_file_size(file, dest, source->size) != 1) {
+		return -EIO;
+	}
+
+	return 0;
+}
+
+//Copies length bytes the slow way, through a buffer
+static int copy_range(FILE *file, struct cs1550_file *source, off_t src_offset, struct cs1550_file *dest, off_t dest_offset, size_t length) {
+
+	char *data = malloc(length + 1);
+	int res;
+
+	if (data == NULL) {
+		return -ENOMEM;
+	}
+
+	res = read_data(file, source, data, length, src_offset);
+
+	if (res >= 0) {
+		res = write_data(file, dest, data, res, dest_offset);
+	}
+
+	free(data);
+
+	return res < 0 ? res : 0;
+}
+
+//Shares the units a range covers when both files lay their data out the same
+//way and the range starts on a unit boundary in each. Whatever is left over
+//at the end, or the whole range when sharing is not possible, is copied.
+static int clone_range(FILE *file, struct cs1550_file *source, off_t src_offset, struct cs1550_file *dest, off_t dest_offset, size_t length) {
+
+	size_t unit = data_unit(&source->node);
+	size_t shared = 0;
+	long from, to;
+	int res;
+
+	if (src_offset >= (off_t) source->size) {
+		return 0;
+	}
+
+	if (src_offset + length > source->size) {
+		length = source->size - src_offset;
+	}
+
+	if (source->location != dest->location && source->node.value == dest->node.value && !(source->node.value & NODE_INLINE) && src_offset % unit == 0 && dest_offset % unit == 0) {
+
+		shared = length / unit * unit;
+
+		if ((size_t) dest_offset + shared > unit * NODE_POINTERS) {
+			return -EFBIG;
+		}
+
+		for (from = src_offset / unit, to = dest_offset / unit; from * unit < src_offset + shared; from++, to++) {
+
+			long location = unit_present(&source->node, from) ? source->node.node_pointers[from] : 0;
+
+			punch_unit(file, dest, to);
+
+			while (dest->node.next_node <= to) {
+				dest->node.node_pointers[dest->node.next_node++] = 0;
+			}
+
+			if (location) {
+				refcount_add(file, location, 1);
+			}
+
+			dest->node.node_pointers[to] = location;
+		}
+
+		if (write_block(file, dest->location, &dest->node) != 1) {
+			return -EIO;
+		}
+
+		if (dest_offset + shared > dest->size && set_file_size(file, dest, dest_offset + shared) != 1) {
+			return -EIO;
+		}
+	}
+
+	if (shared < length && (res = copy_range(file, source, src_offset + shared, dest, dest_offset + shared, length - shared)) < 0) {
+		return res;
+	}
+
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//Sets aside a block for every unit of [offset, offset + length) that will
+//need a new one, as far as can be told up front
+static void reserve_blocks(FILE *file, struct cs1550_file *found, off_t offset, size_t length) {
+
+	long first = offset / MAX_DATA_IN_BLOCK;
+	long last = (offset + length - 1) / MAX_DATA_IN_BLOCK;
+	long index;
+	int count = 0;
+
+	reservation.count = reservation.next = 0;
+
+	//compressed units only know their size once they are compressed
+	if (length == 0 || (found->node.value & NODE_COMPRESSED) || last >= (long) NODE_POINTERS) {
+		return;
+	}
+
+	//spilling an inline file stores what it held as well
+	if (found->node.value & NODE_INLINE) {
+		first = 0;
+	}
+
+	for (index = first; index <= last; index++) {
+
+		if ((found->node.value & NODE_INLINE) || !unit_present(&found->node, index) || refcount_get(file, found->node.node_pointers[index])) {
+			count++;
+		}
+	}
+
+	if (count > 1 && (count = retrieve_blocks(file, reservation.blocks, count)) > 0) {
+		reservation.count = count;
+	}
+}
+
+//Gives back whatever the write-back didn't use
+static void release_reservation(FILE *file) {
+
+	free_blocks(file, reservation.blocks + reservation.next, reservation.count - reservation.next);
+
+	reservation.count = reservation.next = 0;
+}
+
+//Writes are held back in memory, one dirty range per file, and only go to
+//disk when the file is flushed or synced, or once delay_kb is used up. By
+//then the whole range is known, so its blocks come out of the bitmap in one
+//go and sit side by side. A file unlinked before that never has its data
+//written at all.
+#define DELAY_FILES 32
+
+static struct cs1550_delayed {
+	char *path;			//null for a free slot
+	long location;		//the file's index node
+	off_t start;		//the range held back
+	size_t length;
+	size_t capacity;
+	char *data;
+	size_t size;		//the file's size, counting what is held back
+} delayed[DELAY_FILES];
+
+static size_t delayed_bytes;
+static pthread_mutex_t delayed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Goes up whenever held-back data goes away, stored or not, so a read that
+//went to the disk without delayed_lock can tell it has to go again
+static unsigned long delayed_generation;
+
+//The slot holding back writes to the file at location, null if there is
+//none. delayed_lock is held for everything from here on.
+static struct cs1550_delayed *delay_find(long location) {
+
+	int index;
+
+	for (index = 0; index < DELAY_FILES; index++) {
+
+		if (delayed[index].path && delayed[index].location == location) {
+			return &delayed[index];
+		}
+	}
+
+	return NULL;
+}
+
+//The slot with the most held back, to make room with
+static struct cs1550_delayed *delay_biggest(void) {
+
+	struct cs1550_delayed *biggest = &delayed[0];
+	int index;
+
+	for (index = 1; index < DELAY_FILES; index++) {
+
+		if (delayed[index].length > biggest->length) {
+			biggest = &delayed[index];
+		}
+	}
+
+	return biggest;
+}
+
+static void delay_release(struct cs1550_delayed *slot) {
+
+	delayed_generation++;
+	delayed_bytes -= slot->length;
+
+	free(slot->path);
+	free(slot->data);
+
+	memset(slot, 0, sizeof(struct cs1550_delayed));
+}
+
+//Stores what a slot holds back and frees the slot. If that fails the slot
+//keeps its data, so the error comes up again when the file is flushed.
+static int delay_writeback(FILE *file, struct cs1550_delayed *slot) {
+
+	struct cs1550_file found;
+	int res = 1;
+
+	if (slot->path == NULL) {
+		return 1;
+	}
+
+	if (slot->length && (res = find_file(file, slot->path, &found)) == 1) {
+
+		reserve_blocks(file, &found, slot->start, slot->length);
+		res = write_data(file, &found, slot->data, slot->length, slot->start);
+		release_reservation(file);
+
+		if (res >= 0) {
+			res = (size_t) res == slot->length ? 1 : -ENOSPC;
+		}
+	}
+
+	if (res == 1) {
+		delay_release(slot);
+	}
+
+	return res;
+}
+
+//Adds a write to the range a slot holds back, which it overlaps or touches
+static int delay_merge(struct cs1550_delayed *slot, const char *buf, size_t size, off_t offset) {
+
+	off_t start = slot->length && slot->start < offset ? slot->start : offset;
+	off_t end = offset + size;
+	size_t length;
+
+	if (slot->length && slot->start + (off_t) slot->length > end) {
+		end = slot->start + slot->length;
+	}
+
+	length = end - start;
+
+	if (length > slot->capacity) {
+
+		size_t capacity = length > 2 * slot->capacity ? length : 2 * slot->capacity;
+		char *data = realloc(slot->data, capacity);
+
+		if (data == NULL) {
+			return -ENOMEM;
+		}
+
+		slot->data = data;
+		slot->capacity = capacity;
+	}
+
+	if (slot->length && start < slot->start) {
+		memmove(slot->data + (slot->start - start), slot->data, slot->length);
+	}
+
+	memcpy(slot->data + (offset - start), buf, size);
+
+	delayed_bytes += length - slot->length;
+
+	slot->start = start;
+	slot->length = length;
+
+	if ((size_t) end > slot->size) {
+		slot->size = end;
+	}
+
+	return 1;
+}
+
+//Holds a write back rather than storing it, sending ranges out when they
+//can't be merged or the buffers are full. Returns what write_data would.
+static int delay_write(FILE *file, struct cs1550_file *found, const char *path, const char *buf, size_t size, off_t offset) {
+
+	size_t limit = (size_t) options.delay_kb * 1024;
+	size_t unit = found->node.value & NODE_COMPRESSED ? GROUP_SIZE : MAX_DATA_IN_BLOCK;
+	size_t current = found->size;
+	struct cs1550_delayed *slot;
+	int index, res = 1;
+
+	if (offset + size > unit * NODE_POINTERS) {
+		return -EFBIG;
+	}
+
+	pthread_mutex_lock(&delayed_lock);
+
+	slot = delay_find(found->location);
+
+	//a write that neither overlaps nor touches the range held back, or is
+	//too big to hold back at all, sends that range out first
+	if (slot && (size > limit || offset > slot->start + (off_t) slot->length || offset + (off_t) size < slot->start)) {
+
+		current = slot->size;
+
+		if ((res = delay_writeback(file, slot)) == 1) {
+			slot = NULL;
+		}
+	}
+
+	if (res == 1 && size > limit) {
+
+		pthread_mutex_unlock(&delayed_lock);
+
+		if ((res = find_file(file, path, found)) != 1) {
+			return res;
+		}
+
+		reserve_blocks(file, found, offset, size);
+		res = write_data(file, found, buf, size, offset);
+		release_reservation(file);
+
+		return res;
+	}
+
+	for (index = 0; res == 1 && !slot && index < DELAY_FILES; index++) {
+
+		if (delayed[index].path == NULL) {
+			slot = &delayed[index];
+		}
+	}
+
+	//every slot is in use, so the biggest range goes out to make room
+	if (res == 1 && !slot && (res = delay_writeback(file, slot = delay_biggest())) != 1) {
+		slot = NULL;
+	}
+
+	if (res == 1 && slot->path == NULL) {
+
+		if ((slot->path = strdup(path)) == NULL) {
+			res = -ENOMEM;
+		}
+
+		slot->location = found->location;
+		slot->size = current;
+	}
+
+	if (res == 1) {
+		res = delay_merge(slot, buf, size, offset);
+	}
+
+	//over the limit, the biggest ranges go out until it fits again. One
+	//that can't be stored stays held back for its own flush to report.
+	for (index = 0; res == 1 && delayed_bytes > limit && index < DELAY_FILES; index++) {
+		delay_writeback(file, delay_biggest());
+	}
+
+	pthread_mutex_unlock(&delayed_lock);
+
+	return res == 1 ? (int) size : res;
+}
+
+//Sends out what is held back for the file at location. Returns 1 if there
+//was something, 0 if not.
+static int delay_sync(FILE *file, long location) {
+
+	struct cs1550_delayed *slot;
+	int res = 0;
+
+	pthread_mutex_lock(&delayed_lock);
+
+	if ((slot = delay_find(location))) {
+		res = delay_writeback(file, slot);
+	}
+
+	pthread_mutex_unlock(&delayed_lock);
+
+	return res;
+}
+
+static int delay_sync_all(FILE *file) {
+
+	int index, res = 1;
+
+	pthread_mutex_lock(&delayed_lock);
+
+	for (index = 0; index < DELAY_FILES; index++) {
+
+		int written = delay_writeback(file, &delayed[index]);
+
+		if (written < 0) {
+			res = written;
+		}
+	}
+
+	pthread_mutex_unlock(&delayed_lock);
+
+	return res;
+}
+
+//Drops what is held back for a file that is going away
+static void delay_forget(long location) {
+
+	struct cs1550_delayed *slot;
+
+	pthread_mutex_lock(&delayed_lock);
+
+	if ((slot = delay_find(location))) {
+		delay_release(slot);
+	}
+
+	pthread_mutex_unlock(&delayed_lock);
+}
+
+//Cuts what is held back for a file being truncated to size
+static void delay_truncate(long location, size_t size) {
+
+	struct cs1550_delayed *slot;
+
+	pthread_mutex_lock(&delayed_lock);
+
+	if ((slot = delay_find(location))) {
+
+		size_t keep = (off_t) size > slot->start ? size - slot->start : 0;
+
+		if (slot->length > keep) {
+
+			delayed_generation++;
+			delayed_bytes -= slot->length - keep;
+			slot->length = keep;
+		}
+
+		slot->size = size;
+	}
+
+	pthread_mutex_unlock(&delayed_lock);
+}
+
+//Raises size to what the file will have once its writes are stored
+static void delay_size(long location, size_t *size) {
+
+	struct cs1550_delayed *slot;
+
+	pthread_mutex_lock(&delayed_lock);
+
+	if ((slot = delay_find(location)) && slot->size > *size) {
+		*size = slot->size;
+	}
+
+	pthread_mutex_unlock(&delayed_lock);
+}
+
+//Reads the file at path into buf, with what is held back laid over what is
+//on disk. The disk is read without delayed_lock, and read again if held-back
+//data was stored or dropped meanwhile, since what was read may predate it.
+static int delay_read(FILE *file, const char *path, char *buf, size_t size, off_t offset) {
+
+	struct cs1550_file found;
+	struct cs1550_delayed *slot;
+	unsigned long generation;
+	int res;
+
+	pthread_mutex_lock(&delayed_lock);
+
+	do {
+
+		generation = delayed_generation;
+
+		pthread_mutex_unlock(&delayed_lock);
+
+		if ((res = find_file(file, path, &found)) == 1) {
+			res = read_data(file, &found, buf, size, offset);
+		}
+
+		pthread_mutex_lock(&delayed_lock);
+
+	} while (generation != delayed_generation);
+
+	if (res >= 0 && (slot = delay_find(found.location))) {
+
+		off_t end = offset + size < slot->size ? offset + (off_t) size : (off_t) slot->size;
+		off_t from = slot->start > offset ? slot->start : offset;
+		off_t to;
+
+		//past the end of what is on disk reads as zeros until stored
+		if (end > offset + res) {
+
+			memset(buf + res, 0, end - offset - res);
+			res = end - offset;
+		}
+
+		to = slot->start + (off_t) slot->length < offset + res ? slot->start + (off_t) slot->length : offset + res;
+
+		if (from < to) {
+			memcpy(buf + (from - offset), slot->data + (from - slot->start), to - from);
+		}
+	}
+
+	pthread_mutex_unlock(&delayed_lock);
+
+	return res;
+}
+
+//Like find_file, but with anything held back for the file stored first, for
+//callers that work on its blocks directly
+static int find_synced(FILE *file, const char *path, struct cs1550_file *found) {
+
+	int res = find_file(file, path, found);
+
+	if (res == 1 && (res = delay_sync(file, found->location)) == 1) {
+		res = find_file(file, path, found);
+	}
+
+	return res == 0 ? 1 : res;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//The online defragmenter. Every so often it looks over every plain file, and
+//any whose blocks lie in more than one run is copied into a single run taken
+//best-fit from the free-space index. The copy is written before the node and
+//the node is one block, so the file points at either all of its old blocks
+//or all of its new ones. Blocks shared with a snapshot or a clone stay put.
+#define DEFRAG_INTERVAL 30	//seconds between passes
+#define DEFRAG_PATH_MAX 4096
+
+//Every callback holds this for reading. The defragmenter holds it for writing
+//while it moves a file, so nobody sees one half moved.
+static pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static struct cs1550_defrag {
+	pthread_t thread;
+	int running;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+
+	//what the last survey found
+	long files;			//files with data blocks
+	long fragmented;	//of those, the ones in more than one run
+	long runs;
+} defrag = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+struct cs1550_survey {
+	int collect;	//whether to gather paths, which needs the refcounts
+	char **paths;	//fragmented files the defragmenter may move
+	int count;
+	int capacity;
+	long files;
+	long fragmented;
+	long runs;
+};
+
+//How many runs of adjacent blocks a plain file's data lies in
+static int node_runs(cs1550_node *node) {
+
+	long previous = -1;
+	int runs = 0, index;
+
+	for (index = 0; index < node->next_node; index++) {
+
+		long block = node->node_pointers[index];
+
+		if (block == 0) {
+			continue;
+		}
+
+		if (block != previous + 1) {
+			runs++;
+		}
+
+		previous = block;
+	}
+
+	return runs;
+}
+
+//Only plain files that own every one of their blocks are moved
+static int defrag_movable(FILE *file, cs1550_node *node) {
+
+	int index;
+
+	if (node->value & (NODE_INLINE | NODE_COMPRESSED)) {
+		return 0;
+	}
+
+	for (index = 0; index < node->next_node; index++) {
+
+		if (node->node_pointers[index] && refcount_get(file, node->node_pointers[index])) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void survey_add(struct cs1550_survey *survey, const char *path) {
+
+	if (survey->count == survey->capacity) {
+
+		int capacity = survey->capacity ? 2 * survey->capacity : 16;
+		char **paths = realloc(survey->paths, capacity * sizeof(char *));
+
+		if (paths == NULL) {
+			return;
+		}
+
+		survey->paths = paths;
+		survey->capacity = capacity;
+	}
+
+	if ((survey->paths[survey->count] = strdup(path))) {
+		survey->count++;
+	}
+}
+
+static void survey_release(struct cs1550_survey *survey) {
+
+	int index;
+
+	for (index = 0; index < survey->count; index++) {
+		free(survey->paths[index]);
+	}
+
+	free(survey->paths);
+
+	survey->paths = NULL;
+	survey->count = survey->capacity = 0;
+}
+
+//Counts the runs of every file under dir, whose path is the first length
+//bytes of path
+static void survey_directory(FILE *file, struct cs1550_dentry *dir, char *path, size_t length, struct cs1550_survey *survey) {
+
+	struct cs1550_cursor cursor;
+	struct cs1550_dentry entry;
+	char name[MAX_NAME + 1];
+	cs1550_node node;
+	size_t name_length;
+	int runs;
+
+	if (dir_open(file, dir, &cursor) != 1) {
+		return;
+	}
+
+	while (dir_next(file, &cursor, &entry, name) == 1) {
+
+		name_length = strlen(name);
+
+		if (length + name_length + 1 >= DEFRAG_PATH_MAX) {
+			continue;
+		}
+
+		path[length] = '/';
+		memcpy(path + length + 1, name, name_length + 1);
+
+		if (entry.type == DT_DIR) {
+
+			survey_directory(file, &entry, path, length + name_length + 1, survey);
+			continue;
+		}
+
+		if (read_block(file, entry.nStartBlock, &node) != 1 || (node.value & (NODE_INLINE | NODE_COMPRESSED))) {
+			continue;
+		}
+
+		if ((runs = node_runs(&node)) == 0) {
+			continue;
+		}
+
+		survey->files++;
+		survey->runs += runs;
+
+		if (runs > 1) {
+
+			survey->fragmented++;
+
+			if (survey->collect && defrag_movable(file, &node)) {
+				survey_add(survey, path);
+			}
+		}
+	}
+
+	path[length] = '\0';
+}
+
+//Surveys the whole live tree and keeps the totals for the stats
+static void survey_tree(FILE *file, struct cs1550_survey *survey) {
+
+	struct cs1550_dentry root;
+	char path[DEFRAG_PATH_MAX] = "";
+
+	root_entry(&root, root_location);
+	survey_directory(file, &root, path, 0, survey);
+
+	pthread_mutex_lock(&defrag.lock);
+
+	defrag.files = survey->files;
+	defrag.fragmented = survey->fragmented;
+	defrag.runs = survey->runs;
+
+	pthread_mutex_unlock(&defrag.lock);
+}
+
+//Moves a file's data into one run. Returns how many blocks moved, 0 when the
+//file no longer needs it or no run is free that would hold it.
+static long defrag_file(FILE *file, const char *path) {
+
+	struct cs1550_file found;
+	cs1550_disk_block *data;
+	long *old, *fresh;
+	int count = 0, index, done, run;
+
+	if (find_file(file, path, &found) != 1 || !defrag_movable(file, &found.node) || node_runs(&found.node) < 2) {
+		return 0;
+	}
+
+	for (index = 0; index < found.node.next_node; index++) {
+		count += found.node.node_pointers[index] != 0;
+	}
+
+	old = malloc(count * sizeof(long));
+	fresh = malloc(count * sizeof(long));
+	data = malloc(count * sizeof(cs1550_disk_block));
+
+	if (old == NULL || fresh == NULL || data == NULL) {
+
+		free(old);
+		free(fresh);
+		free(data);
+
+		return -1;
+	}
+
+	for (index = 0, done = 0; index < found.node.next_node; index++) {
+
+		if (found.node.node_pointers[index]) {
+			old[done++] = found.node.node_pointers[index];
+		}
+	}
+
+	if (freespace_allocate(file, fresh, count, 1) != count) {
+
+		free(old);
+		free(fresh);
+		free(data);
+
+		return 0;
+	}
+
+	//read a run at a time, then write the copy out in one go
+	for (done = 0; done < count; done += run) {
+
+		for (run = 1; done + run < count && old[done + run] == old[done] + run; run++);
+
+		if (read_blocks(file, old[done], &data[done], run) != 1) {
+			break;
+		}
+	}
+
+	if (done < count || write_blocks(file, fresh[0], data, count) != 1) {
+
+		free_blocks(file, fresh, count);
+		free(old);
+		free(fresh);
+		free(data);
+
+		return -1;
+	}
+
+	for (index = 0, done = 0; index < found.node.next_node; index++) {
+
+		if (found.node.node_pointers[index]) {
+			found.node.node_pointers[index] = fresh[done++];
+		}
+	}
+
+	if (write_block(file, found.location, &found.node) != 1) {
+
+		free_blocks(file, fresh, count);
+		free(old);
+		free(fresh);
+		free(data);
+
+		return -1;
+	}
+
+	for (index = 0; index < count; index++) {
+
+		dedup_forget(old[index]);
+
+		if (options.dedup) {
+			dedup_remember(fresh[index], fingerprint(data[index].data));
+		}
+	}
+
+	free_blocks(file, old, count);
+	stats_defrag(count);
+
+	free(old);
+	free(fresh);
+	free(data);
+
+	return count;
+}
+
+//Waits up to seconds, or until the defragmenter is told to stop. Returns 0
+//once it has been.
+static int defrag_sleep(double seconds) {
+
+	struct timespec until;
+	int running;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+
+	until.tv_sec += (time_t) seconds;
+	until.tv_nsec += (long) ((seconds - (time_t) seconds) * 1e9);
+
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&defrag.lock);
+
+	if (!defrag.stop) {
+		pthread_cond_timedwait(&defrag.wake, &defrag.lock, &until);
+	}
+
+	running = !defrag.stop;
+
+	pthread_mutex_unlock(&defrag.lock);
+
+	return running;
+}
+
+//Surveys the tree and moves every fragmented file it can. With throttle set
+//it keeps to defrag_kbps, counting each block read once and written once.
+//Returns how many files it moved.
+static int defrag_pass(FILE *file, int throttle) {
+
+	struct cs1550_survey survey;
+	int index, moved = 0;
+	long blocks;
+
+	memset(&survey, 0, sizeof(survey));
+	survey.collect = 1;
+
+	pthread_rwlock_rdlock(&tree_lock);
+	survey_tree(file, &survey);
+	pthread_rwlock_unlock(&tree_lock);
+
+	for (index = 0; index < survey.count; index++) {
+
+		pthread_rwlock_wrlock(&tree_lock);
+		blocks = defrag_file(file, survey.paths[index]);
+		pthread_rwlock_unlock(&tree_lock);
+
+		if (blocks <= 0) {
+			continue;
+		}
+
+		moved++;
+
+		if (throttle && !defrag_sleep(2.0 * blocks * BLOCK_SIZE / (options.defrag_kbps ? options.defrag_kbps * 1024.0 : 1024.0))) {
+			break;
+		}
+	}
+
+	survey_release(&survey);
+
+	//the numbers in the stats are for the tree as it is now
+	if (moved) {
+
+		survey.collect = 0;
+
+		pthread_rwlock_rdlock(&tree_lock);
+		survey_tree(file, &survey);
+		pthread_rwlock_unlock(&tree_lock);
+
+		survey_release(&survey);
+	}
+
+	return moved;
+}
+
+static void *defrag_thread(void *unused) {
+
+	(void) unused;
+
+	FILE *file;
+
+	while (defrag_sleep(DEFRAG_INTERVAL)) {
+
+		if ((file = fopen(".disk", "rb+"))) {
+
+			defrag_pass(file, 1);
+			fclose(file);
+		}
+	}
+
+	return NULL;
+}
+
+static void defrag_start(void) {
+
+	defrag.stop = 0;
+	defrag.running = pthread_create(&defrag.thread, NULL, defrag_thread, NULL) == 0;
+}
+
+static void defrag_stop(void) {
+
+	if (!defrag.running) {
+		return;
+	}
+
+	pthread_mutex_lock(&defrag.lock);
+
+	defrag.stop = 1;
+	pthread_cond_signal(&defrag.wake);
+
+	pthread_mutex_unlock(&defrag.lock);
+
+	pthread_join(defrag.thread, NULL);
+	defrag.running = 0;
+}
+
+//Free space is fragmented by however much of it is outside the largest free
+//extent
+static void defrag_print(FILE *out) {
+
+	long blocks, largest;
+	int extents;
+
+	freespace_totals(&blocks, &extents, &largest);
+
+	fprintf(out, "free_blocks %ld\n", blocks);
+	fprintf(out, "free_extents %d\n", extents);
+	fprintf(out, "largest_free_extent %ld\n", largest);
+	fprintf(out, "free_space_fragmentation %.2f%%\n", blocks ? 100.0 * (blocks - largest) / blocks : 0.0);
+
+	pthread_mutex_lock(&defrag.lock);
+
+	fprintf(out, "files_surveyed %ld\n", defrag.files);
+	fprintf(out, "fragmented_files %ld\n", defrag.fragmented);
+	fprintf(out, "runs_per_file %.2f\n", defrag.files ? (double) defrag.runs / defrag.files : 0.0);
+
+	pthread_mutex_unlock(&defrag.lock);
+}
+
+/*
+ * Called whenever the system wants to know the file attributes, including
+ * simply whether the file exists or not.
+ *
+ * man -s 2 stat will show the fields of a stat structure
+ */
+
+static int cs1550_getattr(const char *path, struct stat *stbuf) {
+
+	struct cs1550_dentry entry;
+	int res;
+
+	FILE *file;
+
+	memset(stbuf, 0, sizeof(struct stat));
+
+	if (strcmp(path, STATS_FILE) == 0) {
+		return stats_getattr(stbuf);
+	}
+
+	if (strcmp(path, SNAPSHOTS_FILE) == 0) {
+		return snapshots_getattr(stbuf);
+	}
+
+	file = fopen(".disk", "rb");
+
+	if (!file) {
+		return -EIO;
+	}
+
+	res = walk(file, path, &entry);
+
+	fclose(file);
+
+	if (res != 1) {
+		return res;
+	}
+
+	if (entry.type == DT_DIR) {
+
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	}
+
+	else {
+
+		size_t size = entry.fsize;
+
+		//regular file, probably want to be read and write
+		stbuf->st_mode = S_IFREG | 0666;
+		stbuf->st_nlink = 1; //file links
+
+		//counting whatever is still held back in memory
+		delay_size(entry.nStartBlock, &size);
+		stbuf->st_size = size;
+	}
+
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+/*
+ * Called whenever the contents of a directory are desired. Could be from an 'ls'
+ * or could even be when a user hits TAB to do autocompletion
+ */
+
+static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+
+	//Since we're building with -Wall (all warnings reported) we need
+	//to "use" every parameter, so let's just cast them to void to
+	//satisfy the compiler
+	(void) offset;
+	(void) fi;
+
+	struct cs1550_cursor cursor;
+	struct cs1550_dentry dir, entry;
+	char name[MAX_NAME + 1];
+	int res;
+
+	FILE *file = fopen(".disk", "rb");
+
+	if (!file) {
+		return -EIO;
+	}
+
+	res = walk(file, path, &dir);
+
+	if (res == 1 && dir.type != DT_DIR) {
+		res = -ENOTDIR;
+	}
+
+	if (res == 1 && dir_open(file, &dir, &cursor) != 1) {
+		res = -EIO;
+	}
+
+	if (res != 1) {
+
+		fclose(file);
+		return res;
+	}
+
+	//the filler function allows us to add entries to the listing
+	//read the fuse.h file for a description (in the ../include dir)
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+
+	//a listing is usually followed by a stat of every name in it
+	while ((res = dir_next(file, &cursor, &entry, name)) == 1) {
+
+		dcache_put(dir.nStartBlock, name, strlen(name), &entry);
+		filler(buf, name, NULL, 0);
+	}
+
+	if (dir.root) {
+
+		filler(buf, STATS_FILE + 1, NULL, 0);
+		filler(buf, SNAPSHOTS_FILE + 1, NULL, 0);
+	}
+
+	fclose(file);
+
+	return res < 0 ? -EIO : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+/*
+ * Creates a directory. We can ignore mode since we're not dealing with
+ * permissions, as long as getattr returns appropriate ones for us.
+ */
+
+static int cs1550_mkdir(const char *path, mode_t mode) {
+
+	(void) mode;
+
+	struct cs1550_builder builder;
+	struct cs1550_dentry parent;
+	char name[MAX_NAME + 1];
+	int res;
+
+	FILE *file;
+
+	if (read_only) {
+		return -EROFS;
+	}
+
+	if (strcmp(path, STATS_FILE) == 0 || strcmp(path, SNAPSHOTS_FILE) == 0) {
+		return -EEXIST;
+	}
+
+	file = fopen(".disk", "r+b");
+
+	if (!file) {
+		return -EIO;
+	}
+
+	res = walk_new(file, path, &parent, name);
+
+	//a new directory is one empty block
+	memset(&builder, 0, sizeof(builder));
+
+	if (res == 1 && (res = builder_finish(file, &builder)) == 1 && (res = dir_add(file, &parent, name, DT_DIR, builder.first, NULL)) != 1) {
+		free_block(file, builder.first);
+	}
+
+	if (sync_metadata(file) != 1 && res == 1) {
+		res = -EIO;
+	}
+
+	fclose(file);
+
+	return res == 1 ? 0 : res;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+
+/*
+ * Removes a directory.
+ */
+
+static int cs1550_rmdir(const char *path) {
+
+	struct cs1550_cursor cursor;
+	struct cs1550_dentry entry, child;
+	char name[MAX_NAME + 1];
+	int res;
+
+	FILE *file;
+
+	if (strcmp(path, STATS_FILE) == 0 || strcmp(path, SNAPSHOTS_FILE) == 0) {
+		return -ENOTDIR;
+	}
+
+	if (read_only) {
+		return -EROFS;
+	}
+
+	file = fopen(".disk", "r+b");
+
+	if (!file) {
+		return -EIO;
+	}
+
+	res = walk(file, path, &entry);
+
+	if (res == 1 && entry.root) {
+		res = -EBUSY;
+	}
+
+	else if (res == 1 && entry.type != DT_DIR) {
+		res = -ENOTDIR;
+	}
+
+	//only an empty directory goes
+	else if (res == 1) {
+
+		if (dir_open(file, &entry, &cursor) != 1) {
+			res = -EIO;
+		}
+
+		else if ((res = dir_next(file, &cursor, &child, name)) != 0) {
+			res = res == 1 ? -ENOTEMPTY : -EIO;
+		}
+
+		else {
+			res = dir_remove(file, &entry);
+		}
+	}
+
+	//its blocks may be handed out again as something else
+	if (res == 1) {
+
+		xattr_drop(file, entry.nStartBlock);
+		free_directory_blocks(file, &entry);
+		dcache_flush();
+	}
+
+	if (sync_metadata(file) != 1 && res == 1) {
+		res = -EIO;
+	}
+
+	fclose(file);
+
+	return res == 1 ? 0 : res;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////// SECTION COMPLETE ////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+
+/*
+ * Does the actual creation of a file. Mode and dev can be ignored.
+ *
+ */
+
+static int cs1550_mknod(const char *path, mode_t mode, dev_t dev) {
+
+	(void) mode;
+	(void) dev;
+
+	struct cs1550_dentry parent;
+	char name[MAX_NAME + 1];
+	long nStartBlock = -1;
+	int res;
+
+	cs1550_node new_node;
+
+	FILE *file;
+
+	if (strcmp(path, STATS_FILE) == 0 || strcmp(path, SNAPSHOTS_FILE) == 0) {
+		return -EEXIST;
+	}
+
+	if (read_only) {
+		return -EROFS;
+	}
+
+	file = fopen(".disk", "rb+");
+
+	if (!file) {
+		return -EIO;
+	}
+
+	res = walk_new(file, path, &parent, name);
+
+	if (res == 1 && (nStartBlock = retrieve_block(file)) < 0) {
+		res = -ENOSPC;
+	}
+
+	if (res == 1) {
+
+		memset(&new_node, 0, sizeof(new_node));
+
+		new_node.next_node = 0;
+		new_node.value = NODE_INLINE | (options.compress ? NODE_COMPRESSED : 0);
+
+		if (write_block(file, nStartBlock, &new_node) != 1) {
+			res = -EIO;
+		}
+
+		else {
+			res = dir_add(file, &parent, name, DT_REG, nStartBlock, NULL);
+		}
+
+		if (res != 1) {
+			free_block(file, nStartBlock);
+		}
+	}
+
+	if (sync_metadata(file) != 1 && res == 1) {
+		res = -EIO;
+	}
+
+	fclose(file);
+
+	return res == 1 ? 0 : res;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+/*
+ * Deletes a file
+ */
+
+static int cs1550_unlink(const char *path) {
+
+	struct cs1550_file found;
+	int res;
+
+	FILE *file;
+
+	if (strcmp(path, STATS_FILE) == 0 || strcmp(path, SNAPSHOTS_FILE) == 0) {
+		return -EACCES;
+	}
+
+	if (read_only) {
+		return -EROFS;
+	}
+
+	file = fopen(".disk", "rb+");
+
+	if (file == NULL) {
+		return -EIO;
+	}
+
+	res = find_file(file, path, &found);
+
+	//whatever was never stored is simply dropped
+	if (res == 1) {
+
+		delay_forget(found.location);
+
+		if ((res = dir_remove(file, &found.entry)) == 1) {
+
+			release_units(file, &found);
+			xattr_drop(file, found.location);
+			free_block(file, found.location);
+		}
+	}
+
+	if (sync_metadata(file) != 1 && res == 1) {
+		res = -EIO;
+	}
+
+	fclose(file);
+
+	return res == 1 ? 0 : res;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+/*
+ * Read size bytes from file into buf starting from offset
+ *
+ */
+static int cs1550_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+
+	(void) fi;
+
+	int res;
+
+	FILE *file;
+
+	if (strcmp(path, STATS_FILE) == 0) {
+		return stats_read(buf, size, offset);
+	}
+
+	if (strcmp(path, SNAPSHOTS_FILE) == 0) {
+		return snapshots_read(buf, size, offset);
+	}
+
+	//check that size is > 0
+	if (size <= 0) {
+		return -1;
+	}
+
+	file = fopen(".disk", "rb");
+
+	if (file == NULL) {
+
+		printf("Error Reading File");
+		return -EIO;
+	}
+
+	//reads of a file with writes held back have to see them, and
+	//mustn't miss them going out to the disk while the read is there
+	res = delay_read(file, path, buf, size, offset);
+
+	fclose(file);
+
+	return res;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+/*
+ * Write size bytes from buf into file starting from offset
+ *
+ */
+static int cs1550_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+
+	(void) fi;
+
+	struct cs1550_file found;
+	int res;
+
+	FILE *file;
+
+	if (strcmp(path, STATS_FILE) == 0) {
+		return -EACCES;
+	}
+
+	if (strcmp(path, SNAPSHOTS_FILE) == 0) {
+		return snapshots_write(buf, size);
+	}
+
+	if (read_only) {
+		return -EROFS;
+	}
+
+	//check that size is > 0
+	if (size <= 0) {
+		return -1;
+	}
+
+	file = fopen(".disk", "rb+");
+
+	if (file == NULL) {
+
+		printf("Error Writing File");
+		return -EIO;
+	}
+
+	res = find_file(file, path, &found);
+
+	if (res == 1 && options.delay_kb) {
+		res = delay_write(file, &found, path, buf, size, offset);
+	}
+
+	else if (res == 1) {
+		res = write_data(file, &found, buf, size, offset);
+	}
+
+	if (sync_metadata(file) != 1 && res >= 0) {
+		res = -EIO;
+	}
+
+	fclose(file);
+
+	return res;
+}
+
+/*
+ * Handles chattr +c / -c and lsattr. Switching compression on or off
+ * rewrites whatever the file already holds in the new format. Also
+ * answers CS1550_IOC_SEEK for tools that want to skip over holes, and
+ * CS1550_IOC_CLONE, which copies by sharing blocks.
+ */
+static int cs1550_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+
+	(void) arg;
+	(void) fi;
+
+	struct cs1550_file found;
+	int res;
+
+	FILE *file;
+
+	if (flags & FUSE_IOCTL_COMPAT) {
+		return -ENOSYS;
+	}
+
+	if ((unsigned int) cmd != FS_IOC_GETFLAGS && (unsigned int) cmd != FS_IOC_SETFLAGS && (unsigned int) cmd != CS1550_IOC_SEEK && (unsigned int) cmd != CS1550_IOC_CLONE) {
+		return -ENOTTY;
+	}
+
+	file = fopen(".disk", "rb+");
+
+	if (file == NULL) {
+		return -EIO;
+	}
+
+	res = find_synced(file, path, &found);
+
+	if (res == 1) {
+
+		if ((unsigned int) cmd == FS_IOC_GETFLAGS) {
+
+			*(int *) data = found.node.value & NODE_COMPRESSED ? FS_COMPR_FL : 0;
+			res = 0;
+		}
+
+		else if ((unsigned int) cmd == CS1550_IOC_CLONE) {
+
+			struct cs1550_clone *clone = data;
+			struct cs1550_file source;
+
+			clone->source[sizeof(clone->source) - 1] = '\0';
+
+			if (read_only) {
+				res = -EROFS;
+			}
+
+			else if (clone->src_offset < 0 || clone->dest_offset < 0 || clone->length < 0) {
+				res = -EINVAL;
+			}
+
+			else if ((res = find_synced(file, clone->source, &source)) != 1) {
+				res = res < 0 ? res : -ENOENT;
+			}
+
+			else if (clone->length == 0 && clone->src_offset == 0 && clone->dest_offset == 0) {
+				res = source.location == found.location ? 0 : clone_file(file, &source, &found);
+			}
+
+			else {
+				res = clone_range(file, &source, clone->src_offset, &found, clone->dest_offset, clone->length ? (size_t) clone->length : source.size);
+			}
+		}
+
+		else if ((unsigned int) cmd == CS1550_IOC_SEEK) {
+
+			struct cs1550_seek *seek = data;
+			off_t where = -EINVAL;
+
+			if (seek->whence == SEEK_DATA || seek->whence == SEEK_HOLE) {
+				where = seek_data(&found, seek->offset, seek->whence);
+			}
+
+			if (where >= 0) {
+				seek->offset = where;
+				res = 0;
+			}
+
+			else {
+				res = (int) where;
+			}
+		}
+
+		else if (read_only) {
+			res = -EROFS;
+		}
+
+		else {
+			res = set_compression(file, &found, *(int *) data & FS_COMPR_FL);
+		}
+	}
+
+	if (sync_metadata(file) != 1 && res >= 0) {
+		res = -EIO;
+	}
+
+	fclose(file);
+
+	return res;
+}
+
+/*
+ * Sets space aside for a range of a file, or with FALLOC_FL_PUNCH_HOLE
+ * gives it back. Punched ranges read as zeros and take no blocks.
+ *
+ * A file is one index node with no indirect blocks, so it can never reach
+ * past NODE_POINTERS units: 62 blocks of 504 bytes, 31,248 bytes, for a plain
+ * file, and 62 groups, 124,496 bytes, for a compressed one. Holes count
+ * toward that as much as data does, and anything past it is -EFBIG here as
+ * it is for write and truncate.
+ */
+static int cs1550_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+
+	(void) fi;
+
+	struct cs1550_file found;
+	int res;
+
+	FILE *file;
+
+	if (strcmp(path, STATS_FILE) == 0 || strcmp(path, SNAPSHOTS_FILE) == 0) {
+		return -EACCES;
+	}
+
+	if (read_only) {
+		return -EROFS;
+	}
+
+	if (offset < 0 || length <= 0) {
+		return -EINVAL;
+	}
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) {
+		return -EOPNOTSUPP;
+	}
+
+	//the kernel only allows punching together with KEEP_SIZE
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) {
+		return -EOPNOTSUPP;
+	}
+
+	file = fopen(".disk", "rb+");
+
+	if (file == NULL) {
+		return -EIO;
+	}
+
+	res = find_synced(file, path, &found);
+
+	if (res == 1) {
+
+		if (mode & FALLOC_FL_PUNCH_HOLE) {
+			res = punch_hole(file, &found, offset, length);
+		}
+
+		else {
+			res = preallocate(file, &found, offset, length, mode & FALLOC_FL_KEEP_SIZE);
+		}
+	}
+
+	if (sync_metadata(file) != 1 && res >= 0) {
+		res = -EIO;
+	}
+
+	fclose(file);
+
+	return res;
+}
+
+/*
+ * truncate is called for open(O_TRUNC) and truncate(). A file made shorter
+ * gives back the units past its new end; one made longer reads as zeros up
+ * to it without taking any blocks.
+ *
+ */
+static int cs1550_truncate(const char *path, off_t size)
+{
+	struct cs1550_file found;
+	int res;
+
+	FILE *file;
+
+	if (strcmp(path, STATS_FILE) == 0) {
+		return -EACCES;
+	}
+
+	//"echo create name > .snapshots" truncates before it writes
+	if (strcmp(path, SNAPSHOTS_FILE) == 0) {
+		return 0;
+	}
+
+	if (read_only) {
+		return -EROFS;
+	}
+
+	if (size < 0) {
+		return -EINVAL;
+	}
+
+	file = fopen(".disk", "rb+");
+
+	if (file == NULL) {
+		return -EIO;
+	}
+
+	res = find_file(file, path, &found);
+
+	//what is held back past the new end never gets written
+	if (res == 1) {
+
+		delay_truncate(found.location, size);
+		res = truncate_data(file, &found, size);
+	}
+
+	if (sync_metadata(file) != 1 && res >= 0) {
+		res = -EIO;
+	}
+
+	fclose(file);
+
+	return res;
+}
+
+
+/*
+ * Called when we open a file
+ *
+ */
+static int cs1550_open(const char *path, struct fuse_file_info *fi)
+{
+	//the stats change between reads, so never let the kernel cache them
+	if (strcmp(path, STATS_FILE) == 0) {
+
+		if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+			return -EACCES;
+		}
+
+		fi->direct_io = 1;
+	}
+
+	else if (strcmp(path, SNAPSHOTS_FILE) == 0) {
+		fi->direct_io = 1;
+	}
+
+	else if (read_only && (fi->flags & O_ACCMODE) != O_RDONLY) {
+		return -EROFS;
+	}
+    /*
+        //if we can't find the desired file, return an error
+        return -ENOENT;
+    */
+
+    //It's not really necessary for this project to anything in open
+
+    /* We're not going to worry about permissions for this project, but
+	   if we were and we don't have them to the file we should return an error
+
+        return -EACCES;
+    */
+
+    return 0; //success!
+}
+
+/*
+ * Called when close is called on a file descriptor, but because it might
+ * have been dup'ed, this isn't a guarantee we won't ever need the file
+ * again. For us, return success simply to avoid the unimplemented error
+ * in the debug log.
+ */
+static int cs1550_flush (const char *path , struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	struct cs1550_file found;
+	int res;
+
+	FILE *file;
+
+	//writes held back for the file are stored now, so a close sees any error
+	if (read_only || strcmp(path, STATS_FILE) == 0 || strcmp(path, SNAPSHOTS_FILE) == 0) {
+		return 0;
+	}
+
+	file = fopen(".disk", "rb+");
+
+	if (file == NULL) {
+		return -EIO;
+	}
+
+	res = find_file(file, path, &found);
+
+	if (res == 1) {
+		res = delay_sync(file, found.location);
+	}
+
+	if (sync_metadata(file) != 1 && res >= 0) {
+		res = -EIO;
+	}
+
+	fclose(file);
+
+	return res < 0 ? res : 0; //success!
+}
+
+/*
+ * Called for fsync(). Everything but what is held back in memory is already
+ * on disk by the time a callback returns, so that is all there is to do.
+ */
+static int cs1550_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+	(void) isdatasync;
+
+	return cs1550_flush(path, fi);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/////////////////////////// SECTION COMPLETE /////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+//Where the attributes of whatever path names are kept. The root and the
+//virtual files have nowhere to keep any.
+static int xattr_owner(FILE *file, const char *path, long *location) {
+
+	struct cs1550_dentry entry;
+	int res;
+
+	if (strcmp(path, STATS_FILE) == 0 || strcmp(path, SNAPSHOTS_FILE) == 0 || strcmp(path, "/") == 0) {
+		return -ENOTSUP;
+	}
+
+	if ((res = walk(file, path, &entry)) != 1) {
+		return res;
+	}
+
+	*location = entry.nStartBlock;
+
+	return 1;
+}
+
+/*
+ * Sets an extended attribute. flags may be XATTR_CREATE, to fail if the
+ * attribute exists, or XATTR_REPLACE, to fail if it does not.
+ */
+static int cs1550_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+	long location;
+	int res;
+
+	FILE *file;
+
+	if (read_only) {
+		return -EROFS;
+	}
+
+	if (strlen(name) > XATTR_NAME_MAX) {
+		return -ERANGE;
+	}
+
+	if (size > XATTR_SIZE_MAX) {
+		return -E2BIG;
+	}
+
+	file = fopen(".disk", "rb+");
+
+	if (file == NULL) {
+		return -EIO;
+	}
+
+	if ((res = xattr_owner(file, path, &location)) == 1) {
+		res = xattr_set(file, location, name, value ? value : "", size, flags);
+	}
+
+	if (sync_metadata(file) != 1 && res == 1) {
+		res = -EIO;
+	}
+
+	fclose(file);
+
+	return res == 1 ? 0 : res;
+}
+
+/*
+ * Copies an extended attribute's value into value and returns its size, or
+ * with size 0 just returns the size.
+ */
+static int cs1550_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	long location;
+	int res;
+
+	FILE *file = fopen(".disk", "rb");
+
+	if (file == NULL) {
+		return -EIO;
+	}
+
+	if ((res = xattr_owner(file, path, &location)) == 1) {
+		res = xattr_get(file, location, name, value, size);
+	}
+
+	fclose(file);
+
+	return res == -ENOTSUP ? -ENODATA : res;
+}
+
+/*
+ * Lists the names of a file's extended attributes, each ending in a nul.
+ */
+static int cs1550_listxattr(const char *path, char *list, size_t size)
+{
+	long location;
+	int res;
+
+	FILE *file = fopen(".disk", "rb");
+
+	if (file == NULL) {
+		return -EIO;
+	}
+
+	if ((res = xattr_owner(file, path, &location)) == 1) {
+		res = xattr_list(file, location, list, size);
+	}
+
+	fclose(file);
+
+	return res == -ENOTSUP ? 0 : res;
+}
+
+/*
+ * Removes an extended attribute.
+ */
+static int cs1550_removexattr(const char *path, const char *name)
+{
+	long location;
+	int res;
+
+	FILE *file;
+
+	if (read_only) {
+		return -EROFS;
+	}
+
+	file = fopen(".disk", "rb+");
+
+	if (file == NULL) {
+		return -EIO;
+	}
+
+	if ((res = xattr_owner(file, path, &location)) == 1) {
+		res = xattr_set(file, location, name, NULL, 0, XATTR_REPLACE);
+	}
+
+	if (sync_metadata(file) != 1 && res == 1) {
+		res = -EIO;
+	}
+
+	fclose(file);
+
+	return res == 1 ? 0 : res;
+}
+
+/*
+ * Called once at mount. Brings up the I/O backend, lays out a bitmap sized
+ * to a fresh disk the old one is too small for, and loads the checksum
+ * table, making one first if asked to. With dedup on, the index starts out
+ * knowing every data block already on the disk. With trace set, every
+ * callback from here on is recorded. A writable mount reads the
+ * bitmap into the free-space index and, with defrag on, starts the
+ * defragmenter.
+ */
+static void *cs1550_init(struct fuse_conn_info *conn)
+{
+	(void) conn;
+
+	FILE *file;
+
+	ring_setup(".disk", options.odirect, !options.noring);
+
+	//a disk too big for the old bitmap is laid out before anything is taken
+	if (!read_only && (file = fopen(".disk", "rb+"))) {
+
+		layout_format(file);
+		fclose(file);
+	}
+
+	if (options.trace && (file = fopen(".disk", "rb"))) {
+
+		if (trace_start(options.trace, image_blocks(file)) != 1) {
+			fprintf(stderr, "cs1550: cannot trace to %s\n", options.trace);
+		}
+
+		fclose(file);
+	}
+
+	//a disk that has a table always keeps it up to date, checksum or not
+	if ((file = fopen(".disk", read_only ? "rb" : "rb+"))) {
+
+		if (checksum_load(file) == 1 && checksums.crcs == NULL && options.checksum && !read_only) {
+			checksum_create(file);
+		}
+
+		fclose(file);
+	}
+
+	if (options.dedup && !read_only && (file = fopen(".disk", "rb"))) {
+
+		dedup_scan(file);
+		fclose(file);
+	}
+
+	//a read-only mount never allocates, so it needs no free-space index
+	if (!read_only && (file = fopen(".disk", "rb"))) {
+
+		struct cs1550_survey survey;
+
+		memset(&survey, 0, sizeof(survey));
+
+		freespace_build(file);
+		survey_tree(file, &survey);
+		survey_release(&survey);
+		fclose(file);
+
+		if (options.defrag) {
+			defrag_start();
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Called on unmount. Leaves a copy of the stats next to the disk so the
+ * numbers for the whole session survive the mount.
+ */
+static void cs1550_destroy(void *private_data)
+{
+	(void) private_data;
+
+	FILE *out;
+
+	defrag_stop();
+	trace_stop();
+
+	//nothing held back may be lost at unmount
+	if (!read_only && (out = fopen(".disk", "rb+"))) {
+
+		delay_sync_all(out);
+		sync_metadata(out);
+		fclose(out);
+	}
+
+	out = fopen(STATS_DUMP, "w");
+
+	if (out) {
+		stats_print(out);
+		fclose(out);
+	}
+
+	ring_close();
+	pools_release();
+	checksum_close();
+	freespace_clear();
+	layout_clear();
+}
+
+//Each of these times one callback and records how it went, in the trace
+//too when there is one, before handing the result back to FUSE
+#define TIMED(operation, event, call) { \
+	uint64_t start = stats_now(); \
+	int res; \
+	pthread_rwlock_rdlock(&tree_lock); \
+	res = call; \
+	pthread_rwlock_unlock(&tree_lock); \
+	stats_record(operation, start, res); \
+	if (trace.fd >= 0) { \
+		struct cs1550_event traced = event; \
+		trace_record(operation, start, res, &traced); \
+	} \
+	return res; \
+}
+
+//An ioctl's argument, as much of it as the replayer needs to make it again
+static struct cs1550_event trace_ioctl(const char *path, int cmd, void *data) {
+
+	struct cs1550_event event = TRACE(.path = path, .flags = cmd);
+
+	if ((unsigned int) cmd == CS1550_IOC_CLONE) {
+
+		struct cs1550_clone *clone = data;
+
+		event.name = clone->source;
+		event.offset = clone->src_offset;
+		event.extra = clone->dest_offset;
+		event.size = clone->length;
+	}
+
+	else if ((unsigned int) cmd == CS1550_IOC_SEEK) {
+
+		struct cs1550_seek *seek = data;
+
+		event.offset = seek->offset;
+		event.extra = seek->whence;
+	}
+
+	else if ((unsigned int) cmd == FS_IOC_SETFLAGS) {
+		event.extra = *(int *) data;
+	}
+
+	return event;
+}
+
+static int timed_getattr(const char *path, struct stat *stbuf)
+	TIMED(OP_GETATTR, TRACE(.path = path), cs1550_getattr(path, stbuf))
+
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+	TIMED(OP_READDIR, TRACE(.path = path), cs1550_readdir(path, buf, filler, offset, fi))
+
+static int timed_mkdir(const char *path, mode_t mode)
+	TIMED(OP_MKDIR, TRACE(.path = path), cs1550_mkdir(path, mode))
+
+static int timed_rmdir(const char *path)
+	TIMED(OP_RMDIR, TRACE(.path = path), cs1550_rmdir(path))
+
+static int timed_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+	TIMED(OP_READ, TRACE(.path = path, .offset = offset, .size = size), cs1550_read(path, buf, size, offset, fi))
+
+static int timed_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+	TIMED(OP_WRITE, TRACE(.path = path, .offset = offset, .size = size), cs1550_write(path, buf, size, offset, fi))
+
+static int timed_mknod(const char *path, mode_t mode, dev_t dev)
+	TIMED(OP_MKNOD, TRACE(.path = path), cs1550_mknod(path, mode, dev))
+
+static int timed_unlink(const char *path)
+	TIMED(OP_UNLINK, TRACE(.path = path), cs1550_unlink(path))
+
+static int timed_truncate(const char *path, off_t size)
+	TIMED(OP_TRUNCATE, TRACE(.path = path, .offset = size), cs1550_truncate(path, size))
+
+static int timed_flush(const char *path, struct fuse_file_info *fi)
+	TIMED(OP_FLUSH, TRACE(.path = path), cs1550_flush(path, fi))
+
+static int timed_open(const char *path, struct fuse_file_info *fi)
+	TIMED(OP_OPEN, TRACE(.path = path), cs1550_open(path, fi))
+
+static int timed_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
+	TIMED(OP_IOCTL, trace_ioctl(path, cmd, data), cs1550_ioctl(path, cmd, arg, fi, flags, data))
+
+static int timed_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+	TIMED(OP_FALLOCATE, TRACE(.path = path, .offset = offset, .size = length, .flags = mode), cs1550_fallocate(path, mode, offset, length, fi))
+
+static int timed_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+	TIMED(OP_FSYNC, TRACE(.path = path, .flags = isdatasync), cs1550_fsync(path, isdatasync, fi))
+
+static int timed_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+	TIMED(OP_SETXATTR, TRACE(.path = path, .name = name, .size = size, .flags = flags), cs1550_setxattr(path, name, value, size, flags))
+
+static int timed_getxattr(const char *path, const char *name, char *value, size_t size)
+	TIMED(OP_GETXATTR, TRACE(.path = path, .name = name, .size = size), cs1550_getxattr(path, name, value, size))
+
+static int timed_listxattr(const char *path, char *list, size_t size)
+	TIMED(OP_LISTXATTR, TRACE(.path = path, .size = size), cs1550_listxattr(path, list, size))
+
+static int timed_removexattr(const char *path, const char *name)
+	TIMED(OP_REMOVEXATTR, TRACE(.path = path, .name = name), cs1550_removexattr(path, name))
+
+//register our new functions as the implementations of the syscalls
+static struct fuse_operations hello_oper = {
+    .getattr	= timed_getattr,
+    .readdir	= timed_readdir,
+    .mkdir	= timed_mkdir,
+	.rmdir = timed_rmdir,
+    .read	= timed_read,
+    .write	= timed_write,
+	.mknod	= timed_mknod,
+	.unlink = timed_unlink,
+	.truncate = timed_truncate,
+	.flush = timed_flush,
+	.open	= timed_open,
+	.ioctl = timed_ioctl,
+	.fallocate = timed_fallocate,
+	.fsync = timed_fsync,
+	.setxattr = timed_setxattr,
+	.getxattr = timed_getxattr,
+	.listxattr = timed_listxattr,
+	.removexattr = timed_removexattr,
+	.init = cs1550_init,
+	.destroy = cs1550_destroy,
+};
 
 //////////////////////////////////////////////////////////////////////////
 /////////////////////////// SECTION COMPLETE /////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-/*
- * Read size bytes from file into buf starting from offset
- *
- */
-static int cs1550_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+//The replayer. It reads a trace, makes a fresh image the size of the traced
+//one in a scratch directory and drives the same callbacks with the recorded
+//arguments, without FUSE. Threads take calls in the order they were made,
+//and a call only starts once every call that had finished before it started
+//in the trace has finished here too. Calls that overlapped when traced may
+//overlap again, and nothing else does. The callbacks' stats are the report.
+struct cs1550_replay_call {
+	struct cs1550_trace_record record;
+	char *path;
+	char *name;
+	size_t after;	//how many of the calls before this one must be done first
+	int done;
+};
 
-	(void) buf;
-	(void) offset;
-	(void) fi;
-	(void) path;
+static struct cs1550_replay {
+	struct cs1550_replay_call *calls;
+	size_t count;
+	unsigned threads;
+	size_t largest;		//biggest buffer any call needs
+	uint64_t differed;	//calls whose result was not what was traced
+	int failed;			//a thread could not get its buffer
+	size_t next;		//the next call to hand out
+	size_t finished;	//every call before this one is done
+	pthread_mutex_t lock;
+	pthread_cond_t progress;
+} replay = { .lock = PTHREAD_MUTEX_INITIALIZER, .progress = PTHREAD_COND_INITIALIZER };
+
+//Whether the operation's size is the length of a buffer it passes
+static int replay_buffered(int operation) {
+
+	return operation == OP_READ || operation == OP_WRITE || operation == OP_SETXATTR || operation == OP_GETXATTR || operation == OP_LISTXATTR;
+}
 
-	int directory_location;
-	int file_location;
-	int res = 0;
-	int i;
-	int x;
+static int replay_order(const void *a, const void *b) {
 
-	long file_offset;
+	const struct cs1550_replay_call *first = a, *second = b;
 
-	cs1550_directory_entry entry;
-	cs1550_node node;
+	return (first->record.start > second->record.start) - (first->record.start < second->record.start);
+}
 
-	char extension[MAX_EXTENSION + 1];
-	char directory[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
+static uint64_t replay_end(size_t index) {
+	return replay.calls[index].record.start + replay.calls[index].record.duration;
+}
 
-	memset(extension, 0, MAX_EXTENSION + 1);
-	memset(directory, 0, MAX_FILENAME + 1);
-	memset(filename, 0, MAX_FILENAME + 1);
+static int replay_end_order(const void *a, const void *b) {
 
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	uint64_t first = replay_end(*(const size_t *) a), second = replay_end(*(const size_t *) b);
 
-	FILE *file;
+	return (first > second) - (first < second);
+}
 
-	//check that size is > 0
-	if (size <= 0) {
+//Works out each call's after from when the calls before it ended
+static int replay_dependencies(void) {
+
+	size_t *ending = malloc((replay.count + 1) * sizeof(size_t));
+	size_t index, ended = 0, after = 0;
+
+	if (ending == NULL) {
 		return -1;
 	}
 
-	//check to make sure path exists
-	if (strcmp(path, "/") != 0) {
+	for (index = 0; index < replay.count; index++) {
+		ending[index] = index;
+	}
+
+	qsort(ending, replay.count, sizeof(size_t), replay_end_order);
 
-		memset(&entry, 0, sizeof(cs1550_directory_entry));
-		file = fopen(".disk", "rb+");
+	//calls are in start order, so whatever had ended by one call's start
+	//had ended by the next one's too
+	for (index = 0; index < replay.count; index++) {
 
-		if (file) {
+		for (; ended < replay.count && replay_end(ending[ended]) <= replay.calls[index].record.start; ended++) {
 
-			directory_location = directory_offset(file, directory);
+			if (ending[ended] + 1 > after) {
+				after = ending[ended] + 1;
+			}
+		}
+
+		replay.calls[index].after = after < index ? after : index;
+	}
 
-			if (directory_location) {
-				if (fseek(file, BLOCK_SIZE * directory_location, SEEK_SET) == 0) {
-					if (fread(&entry, 1, BLOCK_SIZE, file) == BLOCK_SIZE) {
-						for (file_location = 0; file_location < entry.nFiles; file_location++) {
+	free(ending);
 
-							if (strcmp(entry.files[file_location].fname, filename) == 0 && strcmp(entry.files[file_location].fext, extension) == 0) {
+	return 1;
+}
 
-								file_offset = entry.files[file_location].nStartBlock;
-								break;
-							}
-						}
+static char *replay_string(const char *bytes, size_t length) {
 
-						if (file_location == entry.nFiles) {
-							return 0;
-						}
+	char *copy = malloc(length + 1);
 
-						if (fseek(file, file_offset * BLOCK_SIZE, SEEK_SET) == 0) {
-							if (fread(&node, 1, BLOCK_SIZE, file) == BLOCK_SIZE) {
+	if (copy) {
+		memcpy(copy, bytes, length);
+		copy[length] = '\0';
+	}
 
-								x = size;
+	return copy;
+}
 
-								while(x > 0) {
+//Reads every call in the trace at path, in the order they were made.
+//Returns the size of the traced image in blocks, -1 on error.
+static long replay_load(const char *path) {
 
-									cs1550_disk_block block;
+	struct cs1550_trace_header header;
+	struct cs1550_replay_call *call;
+	FILE *file = fopen(path, "rb");
+	size_t capacity = 0;
 
-									int index;
-									int v;
+	if (file == NULL) {
+		return -1;
+	}
 
-									fseek(file, node.node_pointers[i] * BLOCK_SIZE, SEEK_SET);
-									fread(&block, 1, BLOCK_SIZE, file);
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC) {
 
-									if (x <= BLOCK_SIZE) {
-										v = size;
-									}
+		fclose(file);
+		return -1;
+	}
 
-									else {
-										v = BLOCK_SIZE;
-									}
+	for (;;) {
 
-									for (index = 0; index < v; index++) {
+		char strings[2 * UINT16_MAX];
 
-										*buf = block.data[index];
-										buf++;
-									}
+		if (replay.count == capacity) {
 
-									i++;
+			size_t bigger = capacity ? 2 * capacity : 1024;
+			struct cs1550_replay_call *calls = realloc(replay.calls, bigger * sizeof(struct cs1550_replay_call));
 
-									res += strlen(block.data);
-									x -= BLOCK_SIZE;
-								}
-							}
-						}
-					}
-				}
+			if (calls == NULL) {
+				break;
 			}
 
-			fclose(file);
+			replay.calls = calls;
+			capacity = bigger;
 		}
 
-		else {
-			printf("Error Reading File");
+		call = &replay.calls[replay.count];
+
+		if (fread(&call->record, sizeof(call->record), 1, file) != 1 || call->record.operation >= OP_COUNT) {
+			break;
+		}
+
+		if (fread(strings, 1, call->record.path_length + call->record.name_length, file) != (size_t) call->record.path_length + call->record.name_length) {
+			break;
+		}
+
+		call->path = replay_string(strings, call->record.path_length);
+		call->name = call->record.name_length ? replay_string(strings + call->record.path_length, call->record.name_length) : NULL;
+		call->done = 0;
+
+		//only these pass a buffer: fallocate and clone keep a length in size
+		//too, and it can be far bigger than any buffer
+		if (replay_buffered(call->record.operation) && call->record.size > replay.largest) {
+			replay.largest = call->record.size;
 		}
+
+		replay.count++;
 	}
 
-	return res;
-}
+	fclose(file);
 
-//////////////////////////////////////////////////////////////////////////
-///////////////////////// SECTION NOT COMPLETE ///////////////////////////
-//////////////////////////////////////////////////////////////////////////
+	qsort(replay.calls, replay.count, sizeof(struct cs1550_replay_call), replay_order);
 
-/*
- * Write size bytes from buf into file starting from offset
- *
- */
-static int cs1550_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	return replay_dependencies() == 1 ? (long) header.blocks : -1;
+}
+
+static int replay_fill(void *buf, const char *name, const struct stat *stbuf, off_t offset) {
 
 	(void) buf;
+	(void) name;
+	(void) stbuf;
 	(void) offset;
-	(void) fi;
-	(void) path;
 
-	int directory_location;
-	int file_location;
-	int data_location;
-	int res = 0;
+	return 0;
+}
 
-	long file_offset;
-	long x;
+//Makes one call again. Written data is a fixed pattern, since the trace
+//keeps sizes, not contents.
+static int replay_call(struct cs1550_replay_call *call, char *buffer) {
 
-	cs1550_directory_entry entry;
-	cs1550_node node;
+	struct cs1550_trace_record *record = &call->record;
+	struct fuse_file_info fi;
+	struct stat stbuf;
+	struct cs1550_clone clone;
+	struct cs1550_seek seek;
+	int flags;
 
-	char extension[MAX_EXTENSION + 1];
-	char directory[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
+	memset(&fi, 0, sizeof(fi));
 
-	memset(extension, 0, MAX_EXTENSION + 1);
-	memset(directory, 0, MAX_FILENAME + 1);
-	memset(filename, 0, MAX_FILENAME + 1);
+	switch (record->operation) {
 
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	case OP_GETATTR:
+		return hello_oper.getattr(call->path, &stbuf);
 
-	FILE *file;
+	case OP_READDIR:
+		return hello_oper.readdir(call->path, NULL, replay_fill, 0, &fi);
 
-	//check that size is > 0
-	if (size <= 0) {
-		return -1;
-	}
+	case OP_MKDIR:
+		return hello_oper.mkdir(call->path, 0755);
 
-	//check to make sure path exists
-	if (strcmp(path, "/") != 0) {
+	case OP_RMDIR:
+		return hello_oper.rmdir(call->path);
 
-		memset(&entry, 0, sizeof(cs1550_directory_entry));
-		file = fopen(".disk", "rb+");
+	case OP_MKNOD:
+		return hello_oper.mknod(call->path, S_IFREG | 0644, 0);
 
-		if (file) {
+	case OP_UNLINK:
+		return hello_oper.unlink(call->path);
 
-			directory_location = directory_offset(file, directory);
+	case OP_READ:
+		return hello_oper.read(call->path, buffer, record->size, record->offset, &fi);
 
-			if (directory_location) {
-				if (fseek(file, BLOCK_SIZE * directory_location, SEEK_SET) == 0) {
-					if (fread(&entry, 1, BLOCK_SIZE, file) == BLOCK_SIZE) {
-						for (file_location = 0; file_location < entry.nFiles; file_location++) {
+	case OP_WRITE:
+		return hello_oper.write(call->path, buffer, record->size, record->offset, &fi);
 
-							if (strcmp(entry.files[file_location].fname, filename) == 0 && strcmp(entry.files[file_location].fext, extension) == 0) {
+	case OP_TRUNCATE:
+		return hello_oper.truncate(call->path, record->offset);
 
-								file_offset = entry.files[file_location].nStartBlock;
-								break;
-							}
-						}
+	case OP_OPEN:
+		return hello_oper.open(call->path, &fi);
 
-						if (file_location == entry.nFiles) {
-							return 0;
-						}
+	case OP_FLUSH:
+		return hello_oper.flush(call->path, &fi);
 
-						if (offset > entry.files[file_location].fsize) {
-							fclose(file);
-							return -EFBIG;
-						}
+	case OP_IOCTL:
 
-						if (fseek(file, file_offset * BLOCK_SIZE, SEEK_SET) == 0) {
-							if (fread(&node, 1, BLOCK_SIZE, file) == BLOCK_SIZE) {
+		if ((unsigned int) record->flags == CS1550_IOC_CLONE) {
 
-								data_location = offset;
-								x = size;
+			memset(&clone, 0, sizeof(clone));
+			strncpy(clone.source, call->name ? call->name : "", sizeof(clone.source) - 1);
+			clone.src_offset = record->offset;
+			clone.dest_offset = record->extra;
+			clone.length = record->size;
 
-								while (x > 0) {
+			return hello_oper.ioctl(call->path, record->flags, NULL, &fi, 0, &clone);
+		}
 
-									int v, location = retrieve_block(file);
+		if ((unsigned int) record->flags == CS1550_IOC_SEEK) {
 
-									cs1550_disk_block block;
+			seek.offset = record->offset;
+			seek.whence = record->extra;
 
-									block.nNextBlock = 0;
+			return hello_oper.ioctl(call->path, record->flags, NULL, &fi, 0, &seek);
+		}
 
-									if (x <= BLOCK_SIZE) {
-										v = x;
-									}
+		flags = record->extra;
 
-									else {
-										v = BLOCK_SIZE;
-									}
+		return hello_oper.ioctl(call->path, record->flags, NULL, &fi, 0, &flags);
 
-									for (data_location = 0; data_location < v; data_location++) {
+	case OP_FALLOCATE:
+		return hello_oper.fallocate(call->path, record->flags, record->offset, record->size, &fi);
 
-										block.data[data_location] = buf[0];
-										buf++;
-									}
+	case OP_FSYNC:
+		return hello_oper.fsync(call->path, record->flags, &fi);
 
-									add_node(file, node, file_offset, location);
+	case OP_SETXATTR:
+		return hello_oper.setxattr(call->path, call->name ? call->name : "", buffer, record->size, record->flags);
 
-									if (fseek(file, location * BLOCK_SIZE, SEEK_SET) == 0) {
-										fwrite(&block, 1, BLOCK_SIZE, file);
-									}
+	case OP_GETXATTR:
+		return hello_oper.getxattr(call->path, call->name ? call->name : "", buffer, record->size);
 
-									data_location = 0;
-									x -= MAX_DATA_IN_BLOCK;
-								}
+	case OP_LISTXATTR:
+		return hello_oper.listxattr(call->path, buffer, record->size);
 
-								entry.files[file_location].fsize = size;
+	case OP_REMOVEXATTR:
+		return hello_oper.removexattr(call->path, call->name ? call->name : "");
+	}
 
-								if (fseek(file, directory_location * BLOCK_SIZE, SEEK_SET) == 0) {
-									fwrite(&entry, 1, BLOCK_SIZE, file);
-								}
+	return -ENOSYS;
+}
 
-								res = size;
-							}
-						}
-					}
-				}
-			}
+static void *replay_thread(void *unused) {
 
-			fclose(file);
+	(void) unused;
+
+	char *buffer = malloc(replay.largest + 1);
+	struct cs1550_replay_call *call;
+	int res;
+
+	//no calls are handed out after this, so the replay stops short and says so
+	if (buffer == NULL) {
+
+		pthread_mutex_lock(&replay.lock);
+
+		fprintf(stderr, "cs1550: no memory for a %zu byte replay buffer\n", replay.largest + 1);
+		replay.failed = 1;
+		replay.next = replay.count;
+
+		pthread_mutex_unlock(&replay.lock);
+
+		return NULL;
+	}
+
+	memset(buffer, 'r', replay.largest + 1);
+
+	pthread_mutex_lock(&replay.lock);
+
+	while (replay.next < replay.count) {
+
+		call = &replay.calls[replay.next++];
+
+		while (replay.finished < call->after) {
+			pthread_cond_wait(&replay.progress, &replay.lock);
 		}
 
-		else {
-			printf("Error Writing File");
+		pthread_mutex_unlock(&replay.lock);
+
+		res = replay_call(call, buffer);
+
+		pthread_mutex_lock(&replay.lock);
+
+		if ((res < 0) != (call->record.result < 0)) {
+			replay.differed++;
+		}
+
+		call->done = 1;
+
+		if (replay.finished < replay.count && replay.calls[replay.finished].done) {
+
+			while (replay.finished < replay.count && replay.calls[replay.finished].done) {
+				replay.finished++;
+			}
+
+			pthread_cond_broadcast(&replay.progress);
 		}
 	}
 
-	return res;
+	pthread_mutex_unlock(&replay.lock);
+
+	free(buffer);
+
+	return NULL;
 }
 
-/******************************************************************************
- *
- *  DO NOT MODIFY ANYTHING BELOW THIS LINE
- *
- *****************************************************************************/
+//Replays the trace at path on threads threads and prints what it took.
+//Returns the exit status for main.
+static int replay_trace(const char *path, unsigned threads) {
 
-/*
- * truncate is called when a new file is created (with a 0 size) or when an
- * existing file is made shorter. We're not handling deleting files or
- * truncating existing ones, so all we need to do here is to initialize
- * the appropriate directory entry.
- *
- */
-static int cs1550_truncate(const char *path, off_t size)
-{
-	(void) path;
-	(void) size;
+	char scratch[] = "/tmp/cs1550-replay-XXXXXX";
+	char here[4096];
+	pthread_t *workers;
+	uint64_t start, elapsed;
+	long blocks = replay_load(path);
+	unsigned thread;
+	size_t index;
+	int fd;
 
-    return 0;
-}
+	if (blocks <= 0) {
 
+		fprintf(stderr, "cs1550: %s is not a trace\n", path);
+		return 1;
+	}
 
-/*
- * Called when we open a file
- *
- */
-static int cs1550_open(const char *path, struct fuse_file_info *fi)
-{
-	(void) path;
-	(void) fi;
-    /*
-        //if we can't find the desired file, return an error
-        return -ENOENT;
-    */
+	replay.threads = threads ? threads : 1;
 
-    //It's not really necessary for this project to anything in open
+	if (getcwd(here, sizeof(here)) == NULL || mkdtemp(scratch) == NULL || chdir(scratch) != 0) {
 
-    /* We're not going to worry about permissions for this project, but
-	   if we were and we don't have them to the file we should return an error
+		fprintf(stderr, "cs1550: no scratch directory for the replay\n");
+		return 1;
+	}
 
-        return -EACCES;
-    */
+	//a fresh image is all zeros: an empty root and an empty bitmap
+	if ((fd = open(".disk", O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(fd, (off_t) blocks * BLOCK_SIZE) != 0) {
 
-    return 0; //success!
-}
+		fprintf(stderr, "cs1550: could not make a %ld block image\n", blocks);
+		return 1;
+	}
 
-/*
- * Called when close is called on a file descriptor, but because it might
- * have been dup'ed, this isn't a guarantee we won't ever need the file
- * again. For us, return success simply to avoid the unimplemented error
- * in the debug log.
- */
-static int cs1550_flush (const char *path , struct fuse_file_info *fi)
-{
-	(void) path;
-	(void) fi;
+	close(fd);
 
-	return 0; //success!
-}
+	if ((workers = calloc(replay.threads, sizeof(pthread_t))) == NULL) {
+		return 1;
+	}
 
+	hello_oper.init(NULL);
 
-//register our new functions as the implementations of the syscalls
-static struct fuse_operations hello_oper = {
-    .getattr	= cs1550_getattr,
-    .readdir	= cs1550_readdir,
-    .mkdir	= cs1550_mkdir,
-	.rmdir = cs1550_rmdir,
-    .read	= cs1550_read,
-    .write	= cs1550_write,
-	.mknod	= cs1550_mknod,
-	.unlink = cs1550_unlink,
-	.truncate = cs1550_truncate,
-	.flush = cs1550_flush,
-	.open	= cs1550_open,
-};
+	start = stats_now();
+
+	for (thread = 0; thread < replay.threads; thread++) {
+		pthread_create(&workers[thread], NULL, replay_thread, NULL);
+	}
+
+	for (thread = 0; thread < replay.threads; thread++) {
+		pthread_join(workers[thread], NULL);
+	}
+
+	elapsed = stats_now() - start;
+
+	if (replay.failed) {
+		fprintf(stderr, "cs1550: the replay stopped before every call was made\n");
+	}
+
+	printf("replayed %zu calls on %u threads in %.3f ms, %llu results differed from the trace\n\n",
+		replay.count, replay.threads, elapsed / 1e6, (unsigned long long) replay.differed);
+
+	stats_print(stdout);
+	hello_oper.destroy(NULL);
+
+	unlink(".disk");
+	unlink(STATS_DUMP);
+
+	if (chdir(here) == 0) {
+		rmdir(scratch);
+	}
+
+	for (index = 0; index < replay.count; index++) {
+
+		free(replay.calls[index].path);
+		free(replay.calls[index].name);
+	}
+
+	free(replay.calls);
+	free(workers);
+
+	replay.calls = NULL;
+	replay.count = replay.next = replay.finished = replay.largest = replay.differed = 0;
+
+	if (replay.failed) {
+
+		replay.failed = 0;
+		return 1;
+	}
+
+	return 0;
+}
 
-//Don't change this.
+//Our own mount options are taken out before FUSE sees the rest
 int main(int argc, char *argv[])
 {
-	return fuse_main(argc, argv, &hello_oper, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+	options.delay_kb = DELAY_DEFAULT_KB;
+	options.defrag_kbps = DEFRAG_DEFAULT_KBPS;
+
+	if (fuse_opt_parse(&args, &options, cs1550_opts, NULL) == -1) {
+		return 1;
+	}
+
+	pool_limit = (size_t) options.pool_kb * 1024;
+
+	//a replay runs the callbacks itself and never mounts anything
+	if (options.replay) {
+		return replay_trace(options.replay, options.replay_threads);
+	}
+
+	//a snapshot is mounted by pointing the root at its frozen copy
+	if (options.snapshot) {
+
+		FILE *file = fopen(".disk", "rb");
+
+		root_location = file ? snapshot_lookup(file, options.snapshot) : 0;
+
+		if (file) {
+			fclose(file);
+		}
+
+		if (root_location == 0) {
+
+			fprintf(stderr, "cs1550: no snapshot named %s\n", options.snapshot);
+			return 1;
+		}
+
+		read_only = 1;
+		fuse_opt_add_arg(&args, "-oro");
+	}
+
+	return fuse_main(args.argc, args.argv, &hello_oper, NULL);
 }
 
 //////////////////////////////////////////////////////////////////////////